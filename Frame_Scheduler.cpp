@@ -0,0 +1,19 @@
+#include "Frame_Scheduler.hpp"
+
+double Frame_Scheduler::WaitTime(double now) const
+{
+	double wait = -1.0;
+
+	for (int i = 0; i < NumWindows; ++i)
+	{
+		if (!pending[i])
+			continue;
+
+		double window_wait = std::max(last_frame[i] + frame_time - now, 0.0);
+
+		if (wait < 0.0 || window_wait < wait)
+			wait = window_wait;
+	}
+
+	return wait;
+}
@@ -0,0 +1,92 @@
+#ifndef FRAME_SCHEDULER_INCLUDED
+#define FRAME_SCHEDULER_INCLUDED
+
+#include "common.hpp"
+
+// Keeps track of why each window needs drawing, so the main loop only
+// draws a window when something it shows has changed, and can block on
+// the event queue when nothing has.
+class Frame_Scheduler
+{
+	public:
+		enum Window
+		{
+			Map,
+			Palette,
+			NumWindows
+		};
+
+		// Reasons a window needs drawing, combined as a mask
+		enum Source : unsigned
+		{
+			Input     = 1 << 0, // Edits, view changes, resizes and exposes
+			Animation = 1 << 1, // The animation timer ticked
+			Loading   = 1 << 2, // The last frame had sprites still loading
+			Scrolling = 1 << 3, // A scroll key is held down
+			Scrollbar = 1 << 4  // The palette scrollbar is fading out
+		};
+
+		// Shortest time between two frames of the same window
+		static constexpr double frame_time = 1.0 / 60.0;
+
+	protected:
+		unsigned pending[NumWindows] = {};
+		bool animated[NumWindows] = {};
+		double last_frame[NumWindows] = {};
+
+	public:
+		void Invalidate(Window window, unsigned sources = Input)
+		{
+			// Animation ticks don't change a window with nothing animated
+			if (sources == Animation && !animated[window])
+				return;
+
+			pending[window] |= sources;
+		}
+
+		void InvalidateAll(unsigned sources = Input)
+		{
+			for (int i = 0; i < NumWindows; ++i)
+				this->Invalidate(Window(i), sources);
+		}
+
+		bool Pending(Window window) const
+		{
+			return pending[window] != 0;
+		}
+
+		// True if the window should be drawn now, at most once per frame_time
+		bool Due(Window window, double now) const
+		{
+			return pending[window] && now >= last_frame[window] + frame_time;
+		}
+
+		// Returns why the window needs drawing and clears it, for the
+		// caller to draw it straight away
+		unsigned BeginFrame(Window window, double now)
+		{
+			unsigned sources = pending[window];
+			pending[window] = 0;
+			last_frame[window] = now;
+			return sources;
+		}
+
+		// Set after drawing a window, to whether it has anything animated
+		void SetAnimated(Window window, bool animated_)
+		{
+			animated[window] = animated_;
+		}
+
+		// True if the animation timer needs to run
+		bool Animating() const
+		{
+			return std::find(std::begin(animated), std::end(animated), true) != std::end(animated);
+		}
+
+		// Seconds the main loop can wait for events before a window is due,
+		// or a negative number if nothing needs drawing and it can wait
+		// forever
+		double WaitTime(double now) const;
+};
+
+#endif // FRAME_SCHEDULER_INCLUDED
@@ -0,0 +1,366 @@
+#include "GFX_Cache.hpp"
+
+#include <algorithm>
+
+#include <sys/stat.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif // WIN32
+
+extern "C"
+{
+#include "crc32.h"
+}
+
+// Cache files are a header with the EGF's key and bitmap table, followed by
+// sprite records, each with its decoded pixels. Later records for a sprite
+// replace earlier ones, and an incomplete record at the end is ignored.
+static const char cache_magic[8] = {'E', 'O', 'M', 'A', 'P', 'G', 'F', 'X'};
+static const std::uint32_t cache_version = 3;
+static const std::uint32_t sprite_magic = 0x54525053; // "SPRT"
+
+// Bounds checked reads from a mapped cache file
+struct cache_reader
+{
+	const char* data;
+	std::size_t size;
+	std::size_t pos = 0;
+
+	template <class T> bool get(T& value)
+	{
+		if (sizeof(T) > size - pos)
+			return false;
+
+		std::memcpy(&value, data + pos, sizeof(T));
+		pos += sizeof(T);
+		return true;
+	}
+
+	bool skip(std::size_t n)
+	{
+		if (n > size - pos)
+			return false;
+
+		pos += n;
+		return true;
+	}
+};
+
+// Hashes the start of an EGF file, which holds its PE headers and resource
+// directory, and samples spread through the rest of it
+static std::uint32_t content_hash(const mapped_file& egf)
+{
+	const std::size_t head_size = 256 * 1024;
+	const std::size_t sample_size = 4096;
+	const std::size_t samples = 64;
+
+	const u8* data = reinterpret_cast<const u8*>(egf.data());
+	std::size_t size = egf.size();
+
+	u32 hash = crc32(0, data, std::min(size, head_size));
+
+	if (size > head_size)
+	{
+		for (std::size_t i = 1; i <= samples; ++i)
+		{
+			std::size_t end = head_size + (size - head_size) * i / samples;
+			std::size_t start = std::max(end - std::min(end, sample_size), head_size);
+			hash = crc32(hash, data + start, end - start);
+		}
+	}
+
+	return hash;
+}
+
+static int process_id()
+{
+#ifdef WIN32
+	return int(GetCurrentProcessId());
+#else // WIN32
+	return int(getpid());
+#endif // WIN32
+}
+
+// Moves a finished cache file over the old one. Mappings of the old file
+// in other instances are left as they are, or on Windows, where a mapped
+// file can't be replaced, the new file is given up on.
+static bool replace_file(const std::string& from, const std::string& to)
+{
+#ifdef WIN32
+	return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else // WIN32
+	return std::rename(from.c_str(), to.c_str()) == 0;
+#endif // WIN32
+}
+
+template <class T> static void put(std::vector<char>& buf, const T& value)
+{
+	const char* p = reinterpret_cast<const char*>(&value);
+	buf.insert(buf.end(), p, p + sizeof(T));
+}
+
+GFX_Cache::GFX_Cache(std::string filename_, std::string egf_path, const mapped_file& egf)
+	: filename(std::move(filename_))
+{
+	temp_filename = filename + "." + std::to_string(process_id()) + ".tmp";
+
+	key.egf_path = std::move(egf_path);
+	key.size = egf.size();
+	key.content_hash = content_hash(egf);
+
+	struct stat st;
+
+	if (stat(key.egf_path.c_str(), &st) == 0)
+		key.mtime = st.st_mtime;
+
+	existing = mapped_file(filename.c_str());
+
+	if (!existing || !this->Parse())
+	{
+		existing.close();
+		has_table = false;
+		table.clear();
+		stored.clear();
+	}
+}
+
+std::shared_ptr<GFX_Cache> GFX_Cache::Open(const std::string& filename, const std::string& egf_path, const mapped_file& egf)
+{
+	static std::map<std::string, std::weak_ptr<GFX_Cache>> open_caches;
+
+	std::weak_ptr<GFX_Cache>& open_cache = open_caches[filename];
+	std::shared_ptr<GFX_Cache> cache = open_cache.lock();
+
+	if (!cache)
+	{
+		cache = std::make_shared<GFX_Cache>(filename, egf_path, egf);
+		open_cache = cache;
+	}
+
+	return cache;
+}
+
+GFX_Cache::~GFX_Cache()
+{
+	if (!fh)
+		return;
+
+	// Sprites from the old file that weren't replaced are carried over
+	for (auto&& entry : stored)
+	{
+		if (written.count(entry.first) == 0)
+			this->WriteSprite(entry.first, entry.second.request_format, entry.second.sprite);
+	}
+
+	if (!fh)
+		return;
+
+	bool ok = (std::fclose(fh) == 0);
+	fh = nullptr;
+
+	existing.close();
+
+	if (!ok || !replace_file(temp_filename, filename))
+		std::remove(temp_filename.c_str());
+}
+
+bool GFX_Cache::Parse()
+{
+	cache_reader reader{existing.data(), existing.size()};
+
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t path_size;
+
+	if (!reader.get(magic) || std::memcmp(magic, cache_magic, sizeof magic) != 0
+	 || !reader.get(version) || version != cache_version
+	 || !reader.get(path_size) || path_size != key.egf_path.size())
+		return false;
+
+	const char* path = reader.data + reader.pos;
+
+	if (!reader.skip(path_size) || std::memcmp(path, key.egf_path.data(), path_size) != 0)
+		return false;
+
+	Key file_key;
+	std::uint32_t table_size;
+
+	if (!reader.get(file_key.size) || file_key.size != key.size
+	 || !reader.get(file_key.mtime) || file_key.mtime != key.mtime
+	 || !reader.get(file_key.content_hash) || file_key.content_hash != key.content_hash
+	 || !reader.get(table_size))
+		return false;
+
+	for (std::uint32_t i = 0; i < table_size; ++i)
+	{
+		std::int32_t id, width, height;
+		std::uint64_t start, size;
+
+		if (!reader.get(id) || !reader.get(start) || !reader.get(size)
+		 || !reader.get(width) || !reader.get(height))
+			return false;
+
+		table.insert({id, {std::size_t(start), std::size_t(size), width, height}});
+	}
+
+	has_table = true;
+
+	for (;;)
+	{
+		std::uint32_t magic;
+		std::int32_t id, width, height, request_format, format;
+		unsigned char color[4];
+		std::uint64_t pixels_size;
+
+		if (!reader.get(magic) || magic != sprite_magic
+		 || !reader.get(id) || !reader.get(width) || !reader.get(height)
+		 || !reader.get(request_format) || !reader.get(format)
+		 || !reader.get(color) || !reader.get(pixels_size))
+			break;
+
+		if (width <= 0 || height <= 0 || pixels_size != std::uint64_t(width) * height * 4)
+			break;
+
+		const char* pixels = reader.data + reader.pos;
+
+		if (!reader.skip(std::size_t(pixels_size)))
+			break;
+
+		Sprite sprite;
+		sprite.width = width;
+		sprite.height = height;
+		sprite.format = ALLEGRO_PIXEL_FORMAT(format);
+		sprite.pixels = pixels;
+		sprite.r = color[0];
+		sprite.g = color[1];
+		sprite.b = color[2];
+		sprite.coverage = color[3];
+
+		// Records appended later replace any earlier one for the sprite
+		stored[id] = {ALLEGRO_PIXEL_FORMAT(request_format), sprite};
+	}
+
+	return true;
+}
+
+bool GFX_Cache::StartWrite()
+{
+	if (fh)
+		return true;
+
+	if (write_failed || !has_table)
+		return false;
+
+	fh = std::fopen(temp_filename.c_str(), "wb");
+
+	if (!fh)
+	{
+		write_failed = true;
+		return false;
+	}
+
+	std::vector<char> header(cache_magic, cache_magic + sizeof cache_magic);
+	put(header, cache_version);
+	put(header, std::uint32_t(key.egf_path.size()));
+	header.insert(header.end(), key.egf_path.begin(), key.egf_path.end());
+	put(header, key.size);
+	put(header, key.mtime);
+	put(header, key.content_hash);
+	put(header, std::uint32_t(table.size()));
+
+	for (auto&& entry : table)
+	{
+		put(header, std::int32_t(entry.first));
+		put(header, std::uint64_t(entry.second.start));
+		put(header, std::uint64_t(entry.second.size));
+		put(header, std::int32_t(entry.second.width));
+		put(header, std::int32_t(entry.second.height));
+	}
+
+	this->Write(header.data(), header.size());
+	return fh != nullptr;
+}
+
+void GFX_Cache::Write(const void* data, std::size_t size)
+{
+	if (fh && std::fwrite(data, 1, size, fh) != size)
+	{
+		std::fclose(fh);
+		fh = nullptr;
+		std::remove(temp_filename.c_str());
+		write_failed = true;
+	}
+}
+
+void GFX_Cache::WriteSprite(int id, ALLEGRO_PIXEL_FORMAT request_format, const Sprite& sprite)
+{
+	std::uint64_t pixels_size = std::uint64_t(sprite.width) * sprite.height * 4;
+	unsigned char color[4] = {sprite.r, sprite.g, sprite.b, sprite.coverage};
+
+	std::vector<char> record;
+	put(record, sprite_magic);
+	put(record, std::int32_t(id));
+	put(record, std::int32_t(sprite.width));
+	put(record, std::int32_t(sprite.height));
+	put(record, std::int32_t(request_format));
+	put(record, std::int32_t(sprite.format));
+	put(record, color);
+	put(record, pixels_size);
+
+	this->Write(record.data(), record.size());
+	this->Write(sprite.pixels, std::size_t(pixels_size));
+}
+
+void GFX_Cache::Create(const std::map<int, pe_reader::BitmapInfo>& table_)
+{
+	a5::Lock lock(write_mutex);
+
+	if (fh)
+	{
+		std::fclose(fh);
+		fh = nullptr;
+	}
+
+	existing.close();
+	stored.clear();
+	written.clear();
+
+	table = table_;
+	has_table = true;
+	write_failed = false;
+
+	this->StartWrite();
+}
+
+bool GFX_Cache::Find(int id, ALLEGRO_PIXEL_FORMAT request_format, Sprite& out) const
+{
+	auto it = stored.find(id);
+
+	if (it == stored.end())
+		return false;
+
+	if (request_format != ALLEGRO_PIXEL_FORMAT_ANY && request_format != it->second.request_format)
+		return false;
+
+	out = it->second.sprite;
+	return true;
+}
+
+void GFX_Cache::Add(int id, ALLEGRO_PIXEL_FORMAT request_format, const Sprite& sprite)
+{
+	a5::Lock lock(write_mutex);
+
+	// A sprite stored for another format is replaced, as later records win
+	// when the file is parsed
+	auto it = stored.find(id);
+
+	if (it != stored.end() && it->second.request_format == request_format)
+		return;
+
+	if (written.count(id) != 0 || !this->StartWrite())
+		return;
+
+	written.insert(id);
+	this->WriteSprite(id, request_format, sprite);
+}
@@ -0,0 +1,111 @@
+#ifndef GFX_CACHE_INCLUDED
+#define GFX_CACHE_INCLUDED
+
+#include "common.hpp"
+
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "mapped_file.hpp"
+#include "pe_reader.hpp"
+
+// On-disk copy of one EGF file's bitmap table and of the sprites decoded
+// from it, so later runs can skip parsing the file and decoding sprites.
+// The cache is keyed by the EGF's path, size, modification time and a hash
+// of its headers and of samples spread through the rest of it, and is
+// started over whenever any of them change. Only samples are hashed, as
+// reading every byte would cost most of what the cache saves.
+// Sprites are stored uncompressed, as there's no compression library here.
+// A cache file is never changed once written, as other instances may have
+// it mapped. New sprites go in to a temporary file, which replaces the
+// cache file when the cache is destroyed.
+class GFX_Cache
+{
+	public:
+		// A decoded sprite as stored, with pixels pointing in to the cache
+		// file's mapping
+		struct Sprite
+		{
+			int width = 0, height = 0;
+			ALLEGRO_PIXEL_FORMAT format = ALLEGRO_PIXEL_FORMAT_ANY;
+			const char* pixels = nullptr;
+			unsigned char r = 0, g = 0, b = 0, coverage = 0;
+		};
+
+	protected:
+		struct Key
+		{
+			std::string egf_path;
+			std::uint64_t size = 0;
+			std::int64_t mtime = 0;
+			std::uint32_t content_hash = 0;
+		};
+
+		Key key;
+		std::string filename;
+
+		struct Stored_Sprite
+		{
+			ALLEGRO_PIXEL_FORMAT request_format;
+			Sprite sprite;
+		};
+
+		// What was already in the cache file when it was opened
+		mapped_file existing;
+		bool has_table = false;
+		std::map<int, pe_reader::BitmapInfo> table;
+		std::unordered_map<int, Stored_Sprite> stored;
+
+		// The replacement cache file, started when there's first something
+		// new to write. Sprites are appended as they're decoded, from any
+		// thread.
+		std::string temp_filename;
+		std::FILE* fh = nullptr;
+		bool write_failed = false;
+		a5::Mutex write_mutex;
+		std::unordered_set<int> written;
+
+		bool Parse();
+		bool StartWrite();
+		void Write(const void* data, std::size_t size);
+		void WriteSprite(int id, ALLEGRO_PIXEL_FORMAT request_format, const Sprite& sprite);
+
+	public:
+		// egf is the already mapped file at egf_path. Use Open instead, so
+		// that loaders sharing a file share its cache.
+		GFX_Cache(std::string filename, std::string egf_path, const mapped_file& egf);
+
+		static std::shared_ptr<GFX_Cache> Open(const std::string& filename, const std::string& egf_path, const mapped_file& egf);
+
+		GFX_Cache(const GFX_Cache&) = delete;
+		GFX_Cache& operator =(const GFX_Cache&) = delete;
+
+		~GFX_Cache();
+
+		// True if the cache has a bitmap table for the current EGF file
+		bool HasTable() const
+		{
+			return has_table;
+		}
+
+		const std::map<int, pe_reader::BitmapInfo>& Table() const
+		{
+			return table;
+		}
+
+		// Starts a new cache file with the EGF's bitmap table, replacing
+		// any sprites stored for the old one
+		void Create(const std::map<int, pe_reader::BitmapInfo>& table);
+
+		// Finds a sprite that was decoded for request_format in an earlier
+		// run, or for any format if it's ALLEGRO_PIXEL_FORMAT_ANY. Safe to
+		// call from any thread.
+		bool Find(int id, ALLEGRO_PIXEL_FORMAT request_format, Sprite& out) const;
+
+		// Stores a decoded sprite, unless it's already stored for
+		// request_format. Safe to call from any thread.
+		void Add(int id, ALLEGRO_PIXEL_FORMAT request_format, const Sprite& sprite);
+};
+
+#endif // GFX_CACHE_INCLUDED
@@ -1,4 +1,5 @@
 #include "GFX_Loader.hpp"
+#include "Render_Layers.hpp"
 #include "bmp_reader.hpp"
 #include "cio.hpp"
 #include "dib_reader.hpp"
@@ -6,29 +7,94 @@
 
 extern std::string g_eo_install_path;
 
-std::unique_ptr<a5::Bitmap> GFX_Loader::Module::LoadBitmapUncached(int id)
+// Sums up decoded rows for a GFX_Loader::Color_Summary. Rows are in the
+// 32-bit formats dib_reader writes, with alpha in the 4th byte and red and
+// blue in either the 1st or 3rd.
+struct Color_Accumulator
 {
-	auto bmp_table_it = bmp_table.find(id);
+	std::uint64_t c0 = 0, c1 = 0, c2 = 0;
+	std::uint64_t opaque = 0;
+	std::uint64_t total = 0;
 
-	if (bmp_table_it == bmp_table.end())
+	void Add(const char* row, int width)
 	{
-		if (!loader->errbmp)
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(row);
+
+		for (int i = 0; i < width; ++i, p += 4)
 		{
-			loader->errbmp = load_bmp("error.bmp").Release();
+			if (p[3] == 0)
+				continue;
+
+			c0 += p[0];
+			c1 += p[1];
+			c2 += p[2];
+			++opaque;
 		}
 
-		if (!loader->errbmp_ptr)
-			loader->errbmp_ptr = std::make_unique<a5::Bitmap>(loader->errbmp);
+		total += width;
+	}
+
+	GFX_Loader::Color_Summary Result(bool red_first) const
+	{
+		GFX_Loader::Color_Summary summary;
+
+		if (opaque == 0)
+			return summary;
+
+		unsigned char first = c0 / opaque;
+		unsigned char second = c1 / opaque;
+		unsigned char third = c2 / opaque;
+
+		summary.r = red_first ? first : third;
+		summary.g = second;
+		summary.b = red_first ? third : first;
+		summary.coverage = (opaque * 255) / total;
 
-		return std::make_unique<a5::Bitmap>(loader->errbmp, false);
+		return summary;
 	}
+};
 
-	auto&& info = bmp_table_it->second;
+static bool is_red_first(ALLEGRO_PIXEL_FORMAT fmt)
+{
+	return fmt == ALLEGRO_PIXEL_FORMAT_ABGR_8888
+	    || fmt == ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE
+	    || fmt == ALLEGRO_PIXEL_FORMAT_XBGR_8888;
+}
+
+void GFX_Loader::Module::Decode(int id, ALLEGRO_PIXEL_FORMAT format, Decoded_Sprite& out)
+{
+	const pe_reader::BitmapInfo* info = this->Find(id);
 
-	auto buf = std::make_unique<char[]>(info.size);
-	egf_reader.read_resource(buf.get(), info.start, info.size);
+	if (!info)
+	{
+		out.error = true;
+		return;
+	}
 
-	dib_reader reader(buf.get(), info.size);
+	GFX_Cache::Sprite cached;
+
+	if (cache && cache->Find(id, format, cached))
+	{
+		out.width = cached.width;
+		out.height = cached.height;
+		out.format = cached.format;
+		out.pixels.assign(cached.pixels, cached.pixels + std::size_t(cached.width) * cached.height * 4);
+		out.summary = {cached.r, cached.g, cached.b, cached.coverage};
+		return;
+	}
+
+	const char* data = egf_reader.resource(info->start, info->size);
+
+	if (!data)
+	{
+		fprintf(stderr, "Can't read BMP %d/%d\n", file_id, id);
+		fflush(stderr);
+
+		out.error = true;
+		return;
+	}
+
+	dib_reader reader(data, info->size);
 
 	auto check_result = reader.check_format();
 
@@ -37,77 +103,182 @@ std::unique_ptr<a5::Bitmap> GFX_Loader::Module::LoadBitmapUncached(int id)
 		fprintf(stderr, "Can't load BMP %d/%d: %s\n", file_id, id, check_result);
 		fflush(stderr);
 
-		if (!loader->errbmp)
-		{
-			loader->errbmp = load_bmp("error.bmp").Release();
-		}
+		out.error = true;
+		return;
+	}
 
-		if (!loader->errbmp_ptr)
-			loader->errbmp_ptr = std::make_unique<a5::Bitmap>(loader->errbmp);
+	try
+	{
+		out.format = reader.start(format);
+	}
+	catch (std::runtime_error& e)
+	{
+		fprintf(stderr, "Can't load BMP %d/%d: %s\n", file_id, id, e.what());
+		fflush(stderr);
 
-		return std::make_unique<a5::Bitmap>(loader->errbmp, false);
+		out.error = true;
+		return;
 	}
 
-	auto bmp = std::make_unique<a5::Bitmap>(reader.width(), reader.height());
+	out.width = reader.width();
+	out.height = std::abs(reader.height());
 
-	auto dpyfmt = static_cast<ALLEGRO_PIXEL_FORMAT>(
-		al_get_bitmap_format(*bmp)
-	);
+	std::size_t row_bytes = std::size_t(out.width) * 4;
+	out.pixels.resize(row_bytes * out.height);
 
-	auto fmt = static_cast<a5::Pixel_Format::Format>(
-		reader.start(dpyfmt)
-	);
+	Color_Accumulator colors;
 
-	auto lock = bmp->Lock(fmt, a5::Bitmap::WriteOnly);
+	for (int i = 0; i < out.height; ++i)
+	{
+		char* row = &out.pixels[row_bytes * i];
+		reader.read_line(row, i);
+		colors.Add(row, out.width);
+	}
+
+	out.summary = colors.Result(is_red_first(out.format));
+
+	if (cache)
+	{
+		GFX_Cache::Sprite sprite;
+		sprite.width = out.width;
+		sprite.height = out.height;
+		sprite.format = out.format;
+		sprite.pixels = out.pixels.data();
+		sprite.r = out.summary.r;
+		sprite.g = out.summary.g;
+		sprite.b = out.summary.b;
+		sprite.coverage = out.summary.coverage;
+
+		cache->Add(id, format, sprite);
+	}
+}
+
+GFX_Loader::Color_Summary GFX_Loader::Module::SummarizeUncached(int id)
+{
+	const pe_reader::BitmapInfo* info = this->Find(id);
+
+	if (!info)
+		return {};
+
+	GFX_Cache::Sprite cached;
+
+	if (cache && cache->Find(id, ALLEGRO_PIXEL_FORMAT_ANY, cached))
+		return {cached.r, cached.g, cached.b, cached.coverage};
+
+	const char* data = egf_reader.resource(info->start, info->size);
 
-	char* start = reinterpret_cast<char*>(lock.Data());
-	auto pitch = lock.Pitch();
-	int rows = bmp->Height();
+	if (!data)
+		return {};
+
+	dib_reader reader(data, info->size);
+
+	if (reader.check_format())
+		return {};
+
+	ALLEGRO_PIXEL_FORMAT read_fmt;
+
+	try
+	{
+		read_fmt = reader.start(ALLEGRO_PIXEL_FORMAT_ARGB_8888);
+	}
+	catch (std::runtime_error&)
+	{
+		return {};
+	}
+
+	Color_Accumulator colors;
+	std::vector<char> row_buf(reader.width() * 4);
+	int rows = std::abs(reader.height());
 
 	for (int i = 0; i < rows; ++i)
 	{
-		char* row = start + pitch * i;
-		reader.read_line(row, i);
+		reader.read_line(row_buf.data(), i);
+		colors.Add(row_buf.data(), reader.width());
 	}
 
-	return bmp;
+	return colors.Result(is_red_first(read_fmt));
 }
 
 GFX_Loader::Module& GFX_Loader::LoadModule(int file)
 {
-	auto cache_it = module_cache.find(file);
+	if (file < 0 || file >= num_files)
+		EOMAP_ERROR("Invalid gfx file: %d", file);
 
-	if (cache_it != module_cache.end())
-		return cache_it->second;
+	if (modules[file])
+		return *modules[file];
 
 	char suffix[sizeof "/gfx/gfx.egf" + 3];
 	snprintf(suffix, sizeof suffix, "/gfx/gfx%03i.egf", file);
 	std::string filename = g_eo_install_path + suffix;
 
-	cio::stream module_file(filename.c_str(), "rb");
+	mapped_file module_file(filename.c_str());
 
 	if (!module_file)
 		EOMAP_ERROR("Failed to open: %s", filename.c_str());
 
+	std::shared_ptr<GFX_Cache> cache;
+
+	if (!cache_directory.empty())
+	{
+		char cache_name[sizeof "/gfx.cache" + 3];
+		snprintf(cache_name, sizeof cache_name, "/gfx%03i.cache", file);
+		cache = GFX_Cache::Open(cache_directory + cache_name, filename, module_file);
+	}
+
 	pe_reader module_reader(std::move(module_file));
+	std::map<int, pe_reader::BitmapInfo> bmp_map;
+
+	if (cache && cache->HasTable())
+	{
+		bmp_map = cache->Table();
+	}
+	else
+	{
+		if (!module_reader.read_header())
+			EOMAP_ERROR("Failed to load library: %s", filename.c_str());
+
+		bmp_map = module_reader.read_bitmap_table();
+
+		if (cache)
+			cache->Create(bmp_map);
+	}
+
+	// Resource ids are dense from 101, so the table is a flat array
+	int table_size = bmp_map.empty() ? 0 : std::max(bmp_map.rbegin()->first - 99, 0);
+	std::vector<pe_reader::BitmapInfo> bmp_table(table_size, pe_reader::BitmapInfo{0, 0, 0, 0});
+
+	int bmp_count = 0;
+	int max_width = 0;
+	int max_height = 0;
+
+	for (auto&& entry : bmp_map)
+	{
+		if (entry.first < 100)
+			continue;
+
+		bmp_table[entry.first - 100] = entry.second;
+		++bmp_count;
 
-	if (!module_reader.read_header())
-		EOMAP_ERROR("Failed to load library: %s", filename.c_str());
+		max_width = std::max(max_width, entry.second.width);
+		max_height = std::max(max_height, entry.second.height);
+	}
 
-	auto&& bmp_table = module_reader.read_bitmap_table();
+	sprite_cache[file].clear();
+	sprite_cache[file].resize(table_size);
+	summary_cache[file].assign(table_size, std::nullopt);
 
-	auto emplace_result = module_cache.emplace(
-		file,
-		Module{this, file, std::move(module_reader), std::move(bmp_table)}
-	);
+	modules[file].reset(new Module{this, file, std::move(module_reader), std::move(bmp_table), bmp_count, max_width, max_height, std::move(cache)});
 
-	return emplace_result.first->second;
+	return *modules[file];
 }
 
 void GFX_Loader::SetLoadTime(double secs)
 {
 	this->frame_load_until = al_get_time() + secs;
 	this->dummy_frames_loaded = 0;
+
+	if (decodes_finished > 0)
+		this->CollectDecoded();
 }
 
 bool GFX_Loader::CanLoadFrames() const
@@ -123,57 +294,110 @@ void GFX_Loader::Prepare(int file)
 int GFX_Loader::CountBitmaps(int file)
 {
 	GFX_Loader::Module& module = this->LoadModule(file);
-	return module.bmp_table.size();
+	return module.bmp_count;
 }
 
 pe_reader::BitmapInfo GFX_Loader::Info(int file, int id)
 {
-	GFX_Loader::Module& module = this->LoadModule(file);
-
-	auto info_it = module.bmp_table.find(100 + id);
+	const pe_reader::BitmapInfo* info = this->LoadModule(file).Find(100 + id);
 
-	if (info_it == module.bmp_table.end())
+	if (!info)
 		return {};
 
-	return info_it->second;
+	return *info;
+}
+
+int GFX_Loader::MaxWidth(int file)
+{
+	return this->LoadModule(file).max_width;
+}
+
+int GFX_Loader::MaxHeight(int file)
+{
+	return this->LoadModule(file).max_height;
 }
 
 a5::Bitmap& GFX_Loader::Load(int file, int id, int anim)
 {
 	auto info = Info(file, id);
-	bool is_animation = (file == 3 || file == 6) && info.width >= 128;
+	bool is_animation = is_animated(file, info.width);
 
 	if (!is_animation)
 		anim = 0;
 
-	auto cache_it = anim_cache.find(BmpFrame{file, id, anim});
+	// Info has loaded the module, so the file's cache is sized for it
+	std::vector<Cached_Sprite>& file_cache = sprite_cache[file];
+	Cached_Sprite* cached = (std::size_t(id) < file_cache.size()) ? &file_cache[id] : nullptr;
 
-	if (cache_it != anim_cache.end())
-		return *cache_it->second;
+	if (cached && cached->frames[anim])
+	{
+		++this->load_hits;
+		return *cached->frames[anim];
+	}
+
+	// Sprites which failed once aren't read again until the next Reset
+	if (cached && cached->state == Load_State::Error)
+	{
+		++this->load_hits;
+		return *errbmp_ptr;
+	}
+
+	if (id == 0)
+		return this->Placeholder();
+
+	if (!cached)
+	{
+		++this->load_misses;
+		return this->ErrorBitmap();
+	}
 
-	bool is_partially_loaded_animation = is_animation &&
-		std::find_if(
-			anim_cache.begin(),
-			anim_cache.end(),
-			[file, id](auto& entry) { return entry.first.file == file && entry.first.id == id; }
-		) != anim_cache.end();
+	if (cached->state == Load_State::Pending && decodes_finished > 0)
+		this->CollectDecoded();
+
+	// Decoding doesn't use up load time, only uploading does. Visible
+	// sprites go ahead of any prefetches.
+	if (cached->state == Load_State::NotLoaded && !decode_threads.empty())
+	{
+		Decode_Job job{&this->LoadModule(file), id, this->DecodeFormat()};
 
-	bool can_load = (CanLoadFrames() || is_partially_loaded_animation);
+		a5::Lock lock(decode_mutex);
+		decode_jobs.push_front(job);
+		decode_ready.Signal();
 
-	if (!can_load)
+		cached->state = Load_State::Pending;
+	}
+
+	// Needed now, so no longer a prefetch that can be cancelled
+	cached->prefetch = false;
+
+	if (cached->state == Load_State::Pending || !CanLoadFrames())
+	{
 		++this->dummy_frames_loaded;
+		return this->Placeholder();
+	}
+
+	++this->load_misses;
 
-	if (id == 0 || !can_load)
+	if (cached->state == Load_State::Decoded)
 	{
-		if (!nullbmp)
-		{
-			nullbmp = al_create_bitmap(1, 1);
-		}
+		std::unique_ptr<Decoded_Sprite> decoded = std::move(cached->decoded);
+		return this->Upload(file, id, anim, *cached, *decoded);
+	}
+
+	Decoded_Sprite decoded;
+	this->LoadModule(file).Decode(100 + id, this->DecodeFormat(), decoded);
+
+	return this->Upload(file, id, anim, *cached, decoded);
+}
 
-		if (!nullbmp_ptr)
-			nullbmp_ptr = std::make_unique<a5::Bitmap>(nullbmp);
+a5::Bitmap& GFX_Loader::Upload(int file, int id, int anim, Cached_Sprite& cached, const Decoded_Sprite& decoded)
+{
+	summary_cache[file][id] = decoded.summary;
 
-		return *nullbmp_ptr;
+	if (decoded.error)
+	{
+		cached.state = Load_State::Error;
+		return this->ErrorBitmap();
 	}
 
 	bool held = al_is_bitmap_drawing_held();
@@ -181,59 +405,275 @@ a5::Bitmap& GFX_Loader::Load(int file, int id, int anim)
 	if (held)
 		al_hold_bitmap_drawing(false);
 
+	a5::Bitmap bmp(decoded.width, decoded.height);
+
+	{
+		auto fmt = static_cast<a5::Pixel_Format::Format>(decoded.format);
+		auto lock = bmp.Lock(fmt, a5::Bitmap::WriteOnly);
+
+		char* start = reinterpret_cast<char*>(lock.Data());
+		auto pitch = lock.Pitch();
+		std::size_t row_bytes = std::size_t(decoded.width) * 4;
+
+		for (int i = 0; i < decoded.height; ++i)
+			std::memcpy(start + pitch * i, &decoded.pixels[row_bytes * i], row_bytes);
+	}
+
+	// Every frame of an animation is cut from the one decoded bitmap
+	int frames = is_animated(file, decoded.width) ? 4 : 1;
+
+	for (int i = 0; i < frames; ++i)
+	{
+		Sprite_Frame frame = sprite_frame(file, decoded.width, decoded.height, i);
+		a5::Rectangle anim_rect(frame.x, frame.y, frame.x + frame.w, frame.y + frame.h);
+
+		cached.frames[i] = atlas[i]->Add(bmp, anim_rect);
+	}
+
+	cached.state = Load_State::Loaded;
+
+	if (held)
+		al_hold_bitmap_drawing(true);
+
+	return *cached.frames[anim];
+}
+
+void GFX_Loader::CollectDecoded()
+{
+	std::vector<std::unique_ptr<Decoded_Sprite>> results;
+
+	{
+		a5::Lock lock(decode_mutex);
+		results.swap(decode_results);
+		decodes_finished = 0;
+	}
+
+	for (std::unique_ptr<Decoded_Sprite>& result : results)
+	{
+		std::vector<Cached_Sprite>& file_cache = sprite_cache[result->file];
+
+		if (std::size_t(result->id) >= file_cache.size())
+			continue;
+
+		int result_file = result->file;
+		int result_id = result->id;
+		Cached_Sprite& cached = file_cache[result_id];
+
+		// Reset since it was queued
+		if (cached.state != Load_State::Pending)
+			continue;
+
+		cached.decoded = std::move(result);
+		cached.state = Load_State::Decoded;
+
+		decoded_sprites.push_back({result_file, result_id});
+	}
+}
+
+void GFX_Loader::BeginPrefetch()
+{
+	++prefetch_round;
+
+	a5::Lock lock(decode_mutex);
+
+	auto stale = [this](const Decode_Job& job)
+	{
+		Cached_Sprite& cached = sprite_cache[job.module->file_id][job.id];
+
+		if (!cached.prefetch || cached.prefetch_round >= prefetch_round - 1)
+			return false;
+
+		cached.state = Load_State::NotLoaded;
+		cached.prefetch = false;
+		return true;
+	};
+
+	decode_jobs.erase(std::remove_if(decode_jobs.begin(), decode_jobs.end(), stale), decode_jobs.end());
+}
+
+void GFX_Loader::Prefetch(int file, int id, bool cancellable)
+{
+	if (id <= 0)
+		return;
+
 	GFX_Loader::Module& module = this->LoadModule(file);
-	auto bmp_ptr = module.LoadBitmapUncached(100 + id);
-	auto& bmp = *bmp_ptr;
+	std::vector<Cached_Sprite>& file_cache = sprite_cache[file];
 
-	if (bmp == errbmp)
-		return *errbmp_ptr;
+	if (std::size_t(id) >= file_cache.size())
+		return;
 
-	int bmpw = bmp.Width();
-	int bmph = bmp.Height();
+	Cached_Sprite& cached = file_cache[id];
 
-	auto anim_rect = [&]() -> a5::Rectangle
+	if (cached.state == Load_State::Pending && cached.prefetch)
+	{
+		cached.prefetch = cancellable;
+		cached.prefetch_round = prefetch_round;
+	}
+
+	if (cached.state != Load_State::NotLoaded)
+		return;
+
+	if (decode_threads.empty())
+	{
+		if (!CanLoadFrames())
+			return;
+
+		Decoded_Sprite decoded;
+		module.Decode(100 + id, this->DecodeFormat(), decoded);
+		this->Upload(file, id, 0, cached, decoded);
+		return;
+	}
+
+	Decode_Job job{&module, id, this->DecodeFormat()};
+
+	{
+		a5::Lock lock(decode_mutex);
+		decode_jobs.push_back(job);
+		decode_ready.Signal();
+	}
+
+	cached.state = Load_State::Pending;
+	cached.prefetch = cancellable;
+	cached.prefetch_round = prefetch_round;
+}
+
+bool GFX_Loader::Loaded(int file, int id)
+{
+	this->LoadModule(file);
+	std::vector<Cached_Sprite>& file_cache = sprite_cache[file];
+
+	if (id <= 0 || std::size_t(id) >= file_cache.size())
+		return true;
+
+	Load_State state = file_cache[id].state;
+	return state == Load_State::Loaded || state == Load_State::Error;
+}
+
+void GFX_Loader::UploadDecoded()
+{
+	if (decodes_finished > 0)
+		this->CollectDecoded();
+
+	std::size_t uploaded = 0;
+
+	for (; uploaded < decoded_sprites.size() && CanLoadFrames(); ++uploaded)
+	{
+		int file = decoded_sprites[uploaded].first;
+		int id = decoded_sprites[uploaded].second;
+		Cached_Sprite& cached = sprite_cache[file][id];
+
+		// Already uploaded by Load
+		if (cached.state != Load_State::Decoded)
+			continue;
+
+		std::unique_ptr<Decoded_Sprite> decoded = std::move(cached.decoded);
+		this->Upload(file, id, 0, cached, *decoded);
+	}
+
+	decoded_sprites.erase(decoded_sprites.begin(), decoded_sprites.begin() + uploaded);
+}
+
+void GFX_Loader::Decode_Worker::operator()()
+{
+	a5::Lock lock(loader->decode_mutex);
+
+	while (true)
+	{
+		while (!loader->decode_stopping && loader->decode_jobs.empty())
+			loader->decode_ready.Wait(loader->decode_mutex);
+
+		if (loader->decode_stopping)
+			break;
+
+		Decode_Job job = loader->decode_jobs.front();
+		loader->decode_jobs.pop_front();
+
+		auto result = std::make_unique<Decoded_Sprite>();
+		result->file = job.module->file_id;
+		result->id = job.id;
+
+		loader->decode_mutex.Unlock();
+		job.module->Decode(100 + job.id, job.format, *result);
+		loader->decode_mutex.Lock();
+
+		loader->decode_results.push_back(std::move(result));
+		++loader->decodes_finished;
+	}
+}
+
+void GFX_Loader::SetDecodeThreads(int threads)
+{
+	if (!decode_threads.empty())
 	{
-		if (file == 3)
-		{
-			if (bmpw >= 128)
-				return a5::Rectangle(anim * 64, 0, anim * 64 + 64, 32);
-			else
-				return a5::Rectangle(0, 0, 64, 32);
-		}
-		else if (file == 6 && bmpw >= 128)
 		{
-			auto frame_width = bmpw / 4;
-			return a5::Rectangle(anim * frame_width, 0, (anim + 1) * frame_width, bmph);
+			a5::Lock lock(decode_mutex);
+			decode_stopping = true;
+			decode_ready.Broadcast();
 		}
-		else
+
+		for (auto&& thread : decode_threads)
+			thread->Join();
+
+		decode_threads.clear();
+		decode_workers.clear();
+
+		decode_stopping = false;
+		decode_jobs.clear();
+		this->CollectDecoded();
+	}
+
+	// Anything still queued is requested again by the next Load
+	for (std::vector<Cached_Sprite>& file_cache : sprite_cache)
+	{
+		for (Cached_Sprite& cached : file_cache)
 		{
-			return a5::Rectangle(0, 0, bmpw, bmph);
+			if (cached.state == Load_State::Pending)
+				cached.state = Load_State::NotLoaded;
 		}
-	}();
-
-	// Animations larger than 512x512 can't be loaded without increasing the
-	// anim texture atlas size
+	}
 
-	if (anim > 0)
+	for (int i = 0; i < threads; ++i)
 	{
-		if (anim_rect.Width() > 512)
-			anim_rect.x2 = anim_rect.x1 + 512;
+		decode_workers.push_back(std::make_unique<Decode_Worker>(this));
+		decode_threads.push_back(std::make_unique<a5::Thread>(*decode_workers.back()));
+		decode_threads.back()->Start();
+	}
+}
 
-		if (anim_rect.Height() > 512)
-			anim_rect.y2 = anim_rect.y1 + 512;
+a5::Bitmap& GFX_Loader::Placeholder()
+{
+	if (!nullbmp)
+	{
+		nullbmp = al_create_bitmap(1, 1);
 	}
 
-	auto atlas_anim_bmp = atlas[anim]->Add(bmp, anim_rect);
+	if (!nullbmp_ptr)
+		nullbmp_ptr = std::make_unique<a5::Bitmap>(nullbmp);
 
-	auto emplace_result = anim_cache.emplace(
-		BmpFrame{file, id, anim},
-		std::move(atlas_anim_bmp)
-	);
+	return *nullbmp_ptr;
+}
 
-	if (held)
-		al_hold_bitmap_drawing(true);
+ALLEGRO_PIXEL_FORMAT GFX_Loader::DecodeFormat()
+{
+	// The placeholder is made with the same flags as the bitmaps sprites
+	// are uploaded through
+	if (decode_format == ALLEGRO_PIXEL_FORMAT_ANY)
+		decode_format = static_cast<ALLEGRO_PIXEL_FORMAT>(al_get_bitmap_format(this->Placeholder()));
 
-	return *emplace_result.first->second;
+	return decode_format;
+}
+
+a5::Bitmap& GFX_Loader::ErrorBitmap()
+{
+	if (!errbmp)
+	{
+		errbmp = load_bmp("error.bmp").Release();
+	}
+
+	if (!errbmp_ptr)
+		errbmp_ptr = std::make_unique<a5::Bitmap>(errbmp);
+
+	return *errbmp_ptr;
 }
 
 a5::Bitmap& GFX_Loader::LoadRaw(std::string filename)
@@ -248,18 +688,54 @@ a5::Bitmap& GFX_Loader::LoadRaw(std::string filename)
 	return *emplace_result.first->second;
 }
 
+GFX_Loader::Color_Summary GFX_Loader::Summary(int file, int id)
+{
+	GFX_Loader::Module& module = this->LoadModule(file);
+	std::vector<std::optional<Color_Summary>>& file_summaries = summary_cache[file];
+
+	if (id <= 0 || std::size_t(id) >= file_summaries.size())
+		return {};
+
+	std::optional<Color_Summary>& summary = file_summaries[id];
+
+	if (!summary)
+		summary = module.SummarizeUncached(100 + id);
+
+	return *summary;
+}
+
 bool GFX_Loader::IsError(a5::Bitmap& bmp)
 {
 	return (ALLEGRO_BITMAP*)bmp == errbmp;
 }
 
+bool GFX_Loader::IsPlaceholder(a5::Bitmap& bmp)
+{
+	return (ALLEGRO_BITMAP*)bmp == nullbmp;
+}
+
 void GFX_Loader::Reset()
 {
-	anim_cache.clear();
+	{
+		a5::Lock lock(decode_mutex);
+		decode_jobs.clear();
+	}
+
+	decoded_sprites.clear();
+
+	// Decodes already running are dropped when they're collected
+	for (std::vector<Cached_Sprite>& file_cache : sprite_cache)
+	{
+		std::size_t size = file_cache.size();
+		file_cache.clear();
+		file_cache.resize(size);
+	}
 
 	if (!atlas[0])
 	{
-		int max_size = al_get_display_option(al_get_current_display(), ALLEGRO_MAX_BITMAP_SIZE);
+		// Without a display the atlases are memory bitmaps, with no limit
+		ALLEGRO_DISPLAY* display = al_get_current_display();
+		int max_size = display ? al_get_display_option(display, ALLEGRO_MAX_BITMAP_SIZE) : 2048;
 
 		if (max_size >= 2048)
 			atlas[0] = std::make_unique<a5::Atlas>(2048, 2048, 32, 32);
@@ -4,47 +4,157 @@
 #include "common.hpp"
 #include "a5ses/Atlas.hpp"
 
+#include <atomic>
+
+#include "GFX_Cache.hpp"
 #include "pe_reader.hpp"
 
 class GFX_Loader
 {
+	public:
+		// Average colour of a sprite's opaque pixels, with coverage being
+		// how much of the sprite is opaque (0-255)
+		struct Color_Summary
+		{
+			unsigned char r = 0, g = 0, b = 0;
+			unsigned char coverage = 0;
+		};
+
 	protected:
+		// gfx files are numbered from 1 to 25
+		static constexpr int num_files = 26;
+
+		// A sprite decoded in to memory, rows of width 32-bit pixels in
+		// format, waiting to be uploaded on the main thread
+		struct Decoded_Sprite
+		{
+			int file = 0, id = 0;
+			int width = 0, height = 0;
+			ALLEGRO_PIXEL_FORMAT format = ALLEGRO_PIXEL_FORMAT_ARGB_8888;
+			std::vector<char> pixels;
+			Color_Summary summary;
+			bool error = false;
+		};
+
 		struct Module
 		{
 			GFX_Loader* loader;
 			int file_id;
 			pe_reader egf_reader;
-			std::map<int, pe_reader::BitmapInfo> bmp_table;
+			// Indexed by resource id - 100, with a size of 0 for ids which
+			// aren't in the file
+			std::vector<pe_reader::BitmapInfo> bmp_table;
+			int bmp_count = 0;
+			int max_width = 0;
+			int max_height = 0;
 			//std::map<int, std::unique_ptr<a5::Bitmap>> bmp_cache;
 
-			//a5::Bitmap& LoadBitmap(int id);
-			std::unique_ptr<a5::Bitmap> LoadBitmapUncached(int id);
+			const pe_reader::BitmapInfo* Find(int id) const
+			{
+				std::size_t index = std::size_t(id - 100);
+
+				if (index >= bmp_table.size() || bmp_table[index].size == 0)
+					return nullptr;
+
+				return &bmp_table[index];
+			}
+
+			// Shared with any other loaders using the same cache directory,
+			// or null if the loader has none
+			std::shared_ptr<GFX_Cache> cache;
+
+			// Decodes a bitmap straight from the mapped file, or copies it
+			// from the cache. Safe to call from any thread.
+			void Decode(int id, ALLEGRO_PIXEL_FORMAT format, Decoded_Sprite& out);
+			Color_Summary SummarizeUncached(int id);
 		};
 
-		struct BmpFrame
+		enum class Load_State : unsigned char
 		{
-			int file;
-			int id;
-			int frame;
+			NotLoaded,
+			Pending, // Queued for or being decoded by a decode thread
+			Decoded, // Decoded, waiting for load time to upload it
+			Loaded,
+			Error    // Missing or failed to decode, drawn as errbmp
+		};
 
-			bool operator<(const BmpFrame& other) const noexcept
-			{
-				return (file == other.file)
-					? (id == other.id)
-						? (frame < other.frame)
-						: (id < other.id)
-					: (file < other.file);
-			}
+		// Atlas bitmaps for each frame of a sprite, only the first is used
+		// for sprites which aren't animated. All frames are added at once.
+		struct Cached_Sprite
+		{
+			std::unique_ptr<a5::Bitmap> frames[4];
+			std::unique_ptr<Decoded_Sprite> decoded;
+			Load_State state = Load_State::NotLoaded;
+
+			// Queued by Prefetch and not yet asked for by Load, as of the
+			// prefetch round it was last asked for in
+			bool prefetch = false;
+			int prefetch_round = 0;
 		};
 
-		std::map<BmpFrame, std::unique_ptr<a5::Bitmap>> anim_cache;
-		std::map<int, Module> module_cache;
+		// Indexed by file, then by gfx id. Each file's entries are sized
+		// to its bitmap table when the module is loaded.
+		std::unique_ptr<Module> modules[num_files];
+		std::vector<Cached_Sprite> sprite_cache[num_files];
 		std::map<std::string, std::unique_ptr<a5::Bitmap>> raw_bmp_cache;
 
+		// Filled in whenever a sprite is decoded, and kept across Reset
+		std::vector<std::optional<Color_Summary>> summary_cache[num_files];
+
 		std::unique_ptr<a5::Atlas> atlas[4]{};
 
+		std::string cache_directory;
+
 		Module& LoadModule(int file);
 
+		// Sprites are read and decoded by these threads, so the main
+		// thread only has to upload them
+		struct Decode_Job
+		{
+			Module* module;
+			int id;
+			ALLEGRO_PIXEL_FORMAT format;
+		};
+
+		struct Decode_Worker : public a5::Thread_Proc
+		{
+			GFX_Loader* loader;
+
+			Decode_Worker(GFX_Loader* loader_) : loader(loader_) { }
+
+			void operator()();
+		};
+
+		std::vector<std::unique_ptr<Decode_Worker>> decode_workers;
+		std::vector<std::unique_ptr<a5::Thread>> decode_threads;
+
+		a5::Mutex decode_mutex;
+		a5::Condition decode_ready;
+		std::deque<Decode_Job> decode_jobs;
+		std::vector<std::unique_ptr<Decoded_Sprite>> decode_results;
+		bool decode_stopping = false;
+
+		// Size of decode_results, readable without taking decode_mutex
+		std::atomic<int> decodes_finished{0};
+
+		// Pixel format sprites are decoded to, that of new bitmaps
+		ALLEGRO_PIXEL_FORMAT decode_format = ALLEGRO_PIXEL_FORMAT_ANY;
+
+		ALLEGRO_PIXEL_FORMAT DecodeFormat();
+
+		// Sprites collected in the Decoded state, for UploadDecoded
+		std::vector<std::pair<int, int>> decoded_sprites;
+
+		int prefetch_round = 0;
+
+		// Moves finished decodes in to their sprites' cache entries
+		void CollectDecoded();
+
+		a5::Bitmap& Upload(int file, int id, int anim, Cached_Sprite& cached, const Decoded_Sprite& decoded);
+
+		a5::Bitmap& Placeholder();
+		a5::Bitmap& ErrorBitmap();
+
 		ALLEGRO_BITMAP* nullbmp = nullptr;
 		std::unique_ptr<a5::Bitmap> nullbmp_ptr = nullptr;
 
@@ -55,22 +165,90 @@ class GFX_Loader
 		double frame_load_until = 0.0;
 
 		// Number of Load() calls that soft-failed since the last SetLoadTime()
-		// call due to load time allocation being exceeded
+		// call due to load time allocation being exceeded, or the sprite
+		// still being decoded
 		int dummy_frames_loaded = 0;
 
+		// Running totals of Load() calls served from the cache, and of
+		// those which had to decode a bitmap
+		int load_hits = 0;
+		int load_misses = 0;
+
 		void SetLoadTime(double secs);
 		bool CanLoadFrames() const;
 
-		GFX_Loader() { Reset(); }
+		// Threads each loader decodes sprites with by default
+		static constexpr int default_decode_threads = 2;
+
+		GFX_Loader()
+		{
+			Reset();
+			SetDecodeThreads(default_decode_threads);
+		}
+
+		GFX_Loader(const GFX_Loader&) = delete;
+		GFX_Loader& operator =(const GFX_Loader&) = delete;
+
+		~GFX_Loader()
+		{
+			SetDecodeThreads(0);
+		}
+
+		// With no threads, sprites are decoded by Load as they're needed
+		void SetDecodeThreads(int threads);
+
+		// Keeps bitmap tables and decoded sprites in directory between
+		// runs, or nowhere if it's empty. Only files loaded after the call
+		// are affected.
+		void SetCacheDirectory(std::string directory)
+		{
+			cache_directory = std::move(directory);
+		}
 
 		void Prepare(int file);
 		int CountBitmaps(int file);
+
+		// Safe to call from other threads only once file's module has been
+		// loaded, with Prepare, as loading it writes to the loader's tables
 		pe_reader::BitmapInfo Info(int file, int id);
+
+		// Largest bitmap dimensions found in a file
+		int MaxWidth(int file);
+		int MaxHeight(int file);
+
 		a5::Bitmap& Load(int file, int id, int anim = 0);
+
+		// Starts a new round of prefetching, cancelling queued prefetches
+		// which weren't asked for again during the last round
+		void BeginPrefetch();
+
+		// Loads a sprite ahead of it being drawn, either by queueing it
+		// behind visible sprites or with whatever load time is left.
+		// Prefetches that aren't cancellable stay queued until they're done.
+		void Prefetch(int file, int id, bool cancellable = true);
+
+		// True once a sprite is loaded, or has failed to load
+		bool Loaded(int file, int id);
+
+		// Uploads decoded sprites while there's load time left
+		void UploadDecoded();
 		a5::Bitmap& LoadRaw(std::string filename);
 
+		// Colour summary of a sprite. Sprites which haven't been loaded yet
+		// are decoded in to memory only, without making a bitmap.
+		Color_Summary Summary(int file, int id);
+
 		bool IsError(a5::Bitmap&);
 
+		// Height of the bitmap Load returns for sprites which are missing
+		int ErrorHeight()
+		{
+			return this->ErrorBitmap().Height();
+		}
+
+		// True if the bitmap is a stand-in for one that hasn't loaded yet
+		bool IsPlaceholder(a5::Bitmap&);
+
 		void Reset();
 };
 
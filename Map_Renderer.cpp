@@ -1,19 +1,34 @@
 #include "Map_Renderer.hpp"
 
+#include <cmath>
+
 #include "Palette.hpp"
+#include "Render_Layers.hpp"
 
-void Map_Renderer::Render()
+static int floor_div(int n, int d)
 {
-    if (map->width <= 0 || map->height <= 0) return;
+	return (n >= 0) ? (n / d) : -((d - 1 - n) / d);
+}
 
-	int target_w = this->target.Width();
-	int target_h = this->target.Height();
+// Calls fn(x, y) for every in-bounds tile in the range, in painter's order
+template <class F> static void for_each_visible_tile(const Map_Renderer::Visible_Tiles& vis, int map_w, int map_h, F fn)
+{
+	for (int diag = vis.diag_min; diag <= vis.diag_max; ++diag)
+	{
+		int x_min = std::max({0, diag - map_h, floor_div(diag + vis.col_min + 1, 2)});
+		int x_max = std::min({map_w, diag, floor_div(diag + vis.col_max, 2)});
 
-	std::vector<short> map_flat(9 * (map->width+1) * (map->height+1), -1);
+		for (int x = x_min; x <= x_max; ++x)
+			fn(x, diag - x);
+	}
+}
+
+void Map_Renderer::RebuildTileGrid()
+{
+	tile_grid.assign(9 * (map->width + 1) * (map->height + 1), -1);
 
 	for (int i = 0; i < 9; ++i)
 	{
-		if (!this->show_layers[i]) continue;
 		for (std::vector<EO_Map::GFX_Row>::iterator row = map->gfxrows[i].begin(); row != map->gfxrows[i].end(); ++row)
 		{
 			if (row->y > map->height)
@@ -28,476 +43,1519 @@ void Map_Renderer::Render()
 					continue;
 				}
 
-				map_flat[row->y * ((map->width + 1) * 9) + (tile->x * 9) + i] = tile->tile;
+				tile_grid[(row->y * (map->width + 1) + tile->x) * 9 + i] = tile->tile;
 			}
 		}
 	}
 
-	int file_map[9] = { 3,  4,  5,  6,  6,  7,  3, 22,  5 };
-	int xoff_map[9] = { 0, -2, -2,  0, 32,  0,  0,-24, -2 };
-	int yoff_map[9] = { 0, -2, -2, -1, -1,-64,-32,-12, -2 };
+	tile_grid_dirty = false;
+}
+
+void Map_Renderer::RebuildGrid()
+{
+	grid_w = map->width + 1;
+	grid_h = map->height + 1;
 
-	int starty = ((((this->yoff + 16) << 1) - (this->xoff)) >> 1) & INT_MAX;
-	int startx = (this->xoff + starty) & INT_MAX;
-	starty = (starty >> 5);
-	startx = (startx >> 5) - 1;
+	grid_vertices.clear();
+	grid_vertices.reserve((grid_w + grid_h + 2) * 2);
 
-	a5::Bitmap& base_gfx = this->gfxloader.Load(3, map->fill_tile, this->animation_state);
-	int base_gfx_w = base_gfx.Width();
-	int base_gfx_h = base_gfx.Height();
+	// Black at half opacity, as outline.bmp was drawn
+	ALLEGRO_COLOR color = al_map_rgba(0, 0, 0, 128);
 
-	for (int ii = 0; ii <= map->width + map->height; ++ii)
+	// Corner i, j is the top of tile i, j
+	auto corner = [&](int i, int j)
 	{
-		int x, y;
-		if (ii < map->height)
-		{
-			x = 0;
-			y = ii;
-		}
-		else
+		ALLEGRO_VERTEX v = {};
+		v.x = float((i - j) * 32 + 32);
+		v.y = float((i + j) * 16) + 0.5f;
+		v.color = color;
+		grid_vertices.push_back(v);
+	};
+
+	for (int i = 0; i <= grid_w; ++i)
+	{
+		corner(i, 0);
+		corner(i, grid_h);
+	}
+
+	for (int j = 0; j <= grid_h; ++j)
+	{
+		corner(0, j);
+		corner(grid_w, j);
+	}
+}
+
+void Map_Renderer::TileChanged(int x, int y)
+{
+	this->Invalidate();
+
+	// Sprites on the tile can reach in to any LOD tile within a sprite's
+	// size of it
+	if (!lod_tiles.empty())
+	{
+		int pad_x = 64;
+		int pad_top = 64;
+
+		for (int file : {3, 4, 5, 6, 7, 22})
 		{
-			x = ii - map->height;
-			y = map->height;
+			pad_x = std::max(pad_x, this->gfxloader.MaxWidth(file));
+			pad_top = std::max(pad_top, this->gfxloader.MaxHeight(file) + 64);
 		}
 
-		while (y >= 0 && x <= map->width)
+		int x1 = (x - y) * 32 - pad_x;
+		int x2 = (x - y) * 32 + 64 + pad_x;
+		int y1 = (x + y) * 16 - pad_top;
+		int y2 = (x + y) * 16 + 64;
+
+		for (auto& entry : lod_tiles)
 		{
-			int xoff = xoff_map[0] - this->xoff;
-			int yoff = yoff_map[0] - this->yoff;
-			short tile = map_flat[y * ((map->width + 1) * 9) + (x * 9)];
-			if (tile >= 0)
-			{
-				a5::Bitmap& gfx = this->gfxloader.Load(file_map[0], tile, animation_state);
-				int gfx_w = gfx.Width();
-				int gfx_h = gfx.Height();
-				int draw_x = xoff + (x << 5) - (y << 5);
-				int draw_y = yoff + (x << 4) + (y << 4);
+			int tile_world = lod_tile_size << entry.first.level;
+			int tile_x = entry.first.tx * tile_world;
+			int tile_y = entry.first.ty * tile_world;
 
-				if ((draw_x + gfx_w) >= 0 && (draw_y + gfx_h) >= 0 && draw_x < target_w && draw_y < target_h)
-				{
-					this->target.Blit(gfx, draw_x, draw_y);
-
-					if (this->gfxloader.IsError(gfx))
-					{
-						al_draw_textf(
-							font, al_map_rgb(255, 255, 255),
-							draw_x + 32, draw_y + 12, ALLEGRO_ALIGN_CENTER,
-							"%d/%d", 0, tile
-						);
-					}
-				}
-			}
-			else
-			{
-				int draw_x = xoff + (x << 5) - (y << 5);
-				int draw_y = yoff + (x << 4) + (y << 4);
+			if (x2 > tile_x && y2 > tile_y && x1 < tile_x + tile_world && y1 < tile_y + tile_world)
+				entry.second.dirty = true;
+		}
+	}
 
-				if ((draw_x + base_gfx_w) >= 0 && (draw_y + base_gfx_h) >= 0 && draw_x < target_w && draw_y < target_h)
-				{
-					this->target.Blit(base_gfx, draw_x, draw_y);
-				}
-			}
+	if (tile_grid_dirty || x < 0 || y < 0 || x > map->width || y > map->height)
+	{
+		this->entity_overlays_dirty = true;
+		return;
+	}
 
-			--y;
-			++x;
-		}
+	short old_object = this->GridTile(x, y, 1);
+
+	for (int i = 0; i < 9; ++i)
+	{
+		EO_Map::GFX* tile = EO_Map::GetTile(map->gfxrows[i], x, y);
+		tile_grid[(y * (map->width + 1) + x) * 9 + i] = tile ? tile->tile : -1;
 	}
 
-	if (this->show_layers[10] || highlight_spec)
+	this->minimap.TileChanged(x, y, &tile_grid[(y * (map->width + 1) + x) * 9]);
+
+	// Entity bubbles are raised above objects
+	if (this->GridTile(x, y, 1) != old_object)
+		this->entity_overlays_dirty = true;
+
+	int cx = x / chunk_tiles;
+	int cy = y / chunk_tiles;
+
+	if (cx < chunks_w && cy < chunks_h)
+		chunks[cy * chunks_w + cx].dirty = true;
+}
+
+void Map_Renderer::RebuildEntityOverlays()
+{
+	enum
 	{
-		a5::Color tint = a5::RGBA(255, 255, 255, 64 * (highlight_spec * 2 + 1));
+		HasWarp = 1,
+		HasChest = 2,
+		HasSign = 4
+	};
 
-		for (std::vector<EO_Map::Tile_Row>::iterator i = map->tilerows.begin(); i != map->tilerows.end(); ++i)
+	// Entity coordinates are bytes, so every possible tile fits in here
+	std::vector<unsigned char> tile_flags(256 * 256);
+
+	for (const EO_Map::Warp_Row& row : map->warprows)
+		for (const EO_Map::Warp& warp : row.tiles)
+			tile_flags[row.y * 256 + warp.x] |= HasWarp;
+
+	for (const EO_Map::Chest& chest : map->chests)
+		tile_flags[chest.y * 256 + chest.x] |= HasChest;
+
+	for (const EO_Map::Sign& sign : map->signs)
+		tile_flags[sign.y * 256 + sign.x] |= HasSign;
+
+	// Bubbles for each kind of entity are stacked above the ones which
+	// come before it in this order
+	auto base_yoff = [&](int x, int y, int stacked_flags)
+	{
+		int object = (x <= map->width && y <= map->height)
+			? this->GridTile(x, y, 1)
+			: map->GetObject(x, y);
+
+		int yoff = -12;
+
+		if (object != -1)
 		{
-			for (std::vector<EO_Map::Tile>::iterator ii = i->tiles.begin(); ii != i->tiles.end(); ++ii)
-			{
-			    a5::Bitmap& gfx = [&]() -> a5::Bitmap&
-				{
-					try
-					{
-						return this->gfxloader.LoadRaw("/specs/" + util::to_string(int(ii->spec)) + ".bmp");
-					}
-					catch (a5::Bitmap::Load_Failed &e)
-					{
-						return this->gfxloader.LoadRaw("/specs/generic.bmp");
-					}
-				}();
-				int gfx_w = gfx.Width();
-				int gfx_h = gfx.Height();
+			// Missing objects are drawn as the error bitmap, so bubbles sit
+			// above that instead
+			int object_h = this->gfxloader.Info(4, object).height;
 
-				int draw_x = (ii->x << 5) - (i->y << 5) - ((int(gfx_w) >> 1) - 32) - xoff;
-				int draw_y = (ii->x << 4) + (i->y << 4) - yoff;
+			if (object_h == 0)
+				object_h = this->gfxloader.ErrorHeight();
 
-				if ((draw_x + gfx_w) >= 0 && (draw_y + gfx_h) >= 0 && draw_x < target_w && draw_y < target_h)
-				{
-					this->target.BlitTinted(gfx, tint, draw_x, draw_y);
-				}
-			}
+			yoff += 22 - object_h;
+		}
+
+		int flags = tile_flags[y * 256 + x] & stacked_flags;
+
+		for (int i = 0; i < 3; ++i)
+			if (flags & (1 << i))
+				yoff -= 25;
+
+		return yoff;
+	};
+
+	entity_overlays.clear();
+
+	for (const EO_Map::Warp_Row& row : map->warprows)
+	{
+		for (const EO_Map::Warp& warp : row.tiles)
+		{
+			int gfxid = warp.door == EO_Map::HasDoor ? 45 : (warp.door == EO_Map::NoDoor ? 44 : 46);
+			a5::Bitmap* gfx = &this->gfxloader.LoadRaw(tiles_spec[0][gfxid]);
+			entity_overlays.push_back({warp.x, row.y, base_yoff(warp.x, row.y, 0), gfx});
 		}
 	}
 
-	for (int ii = 0; ii <= map->width + map->height; ++ii)
+	for (const EO_Map::Chest& chest : map->chests)
+	{
+		int gfxid = map->GetTileSpec(chest.x, chest.y) == 9 ? 43 : 41;
+		a5::Bitmap* gfx = &this->gfxloader.LoadRaw(tiles_spec[0][gfxid]);
+		entity_overlays.push_back({chest.x, chest.y, base_yoff(chest.x, chest.y, HasWarp), gfx});
+	}
+
+	for (const EO_Map::Sign& sign : map->signs)
+	{
+		a5::Bitmap* gfx = &this->gfxloader.LoadRaw(tiles_spec[0][42]);
+		entity_overlays.push_back({sign.x, sign.y, base_yoff(sign.x, sign.y, HasWarp | HasChest), gfx});
+	}
+
+	for (const EO_Map::NPC& npc : map->npcs)
+	{
+		a5::Bitmap* gfx = &this->gfxloader.LoadRaw(tiles_spec[0][47]);
+		entity_overlays.push_back({npc.x, npc.y, base_yoff(npc.x, npc.y, HasWarp | HasChest | HasSign), gfx});
+	}
+
+	entity_overlays_dirty = false;
+}
+
+void Map_Renderer::BuildDrawList(const Visible_Tiles& vis, a5::Rectangle region, Draw_List& list)
+{
+	list.shadows.clear();
+	list.objects.clear();
+	list.roofs.clear();
+
+	int region_x1 = region.x1;
+	int region_y1 = region.y1;
+	int region_x2 = region.x2;
+	int region_y2 = region.y2;
+
+	// Runs on worker threads, so only reads what the main thread has
+	// already set up: the tile grid, resolved sprites, and the modules
+	// RenderRegion loads with Prepare before starting the workers
+	auto add = [&](std::vector<Draw_Command>& cmds, int x, int y, int layer)
 	{
-		int x, y;
-		if (ii < map->height)
+		short tile = GridTile(x, y, layer);
+
+		if (tile < 0)
+			return;
+
+		int file = file_map[layer];
+		const std::vector<a5::Bitmap*>& file_sprites = sprites[file];
+		a5::Bitmap* gfx = (std::size_t(tile) < file_sprites.size()) ? file_sprites[tile] : nullptr;
+
+		int gfx_w, gfx_h;
+
+		if (gfx)
 		{
-			x = 0;
-			y = ii;
+			gfx_w = gfx->Width();
+			gfx_h = gfx->Height();
 		}
 		else
 		{
-			x = ii - map->height;
-			y = map->height;
+			pe_reader::BitmapInfo info = this->gfxloader.Info(file, tile);
+			Sprite_Frame frame = sprite_frame(file, info.width, info.height, animation_state);
+			gfx_w = frame.w;
+			gfx_h = frame.h;
 		}
-		while (y >= 0 && x <= map->width)
-		{
-			int xoff = xoff_map[7] - this->xoff;
-			int yoff = yoff_map[7] - this->yoff;
-			short tile = map_flat[y * ((map->width + 1) * 9) + (x * 9) + 7];
 
-			if (tile >= 0)
-			{
-				a5::Bitmap& gfx = this->gfxloader.Load(file_map[7], tile, animation_state);
-				int gfx_w = gfx.Width();
-				int gfx_h = gfx.Height();
-				int draw_x = xoff + (x * 32) - (y * 32);
-				int draw_y = yoff + (x * 16) + (y * 16);
+		int tile_x = xoff_map[layer] - this->xoff + (x * 32) - (y * 32);
+		int tile_y = yoff_map[layer] - this->yoff + (x * 16) + (y * 16);
+		int draw_x = tile_x;
+		int draw_y = tile_y;
 
-				if ((draw_x + gfx_w) >= 0 && (draw_y + gfx_h) >= 0 && draw_x < target_w && draw_y < target_h)
-				{
-					this->target.BlitTinted(gfx, a5::RGBA(255, 255, 255, 50), draw_x, draw_y);
-
-					if (this->gfxloader.IsError(gfx))
-					{
-						al_draw_textf(
-							font, al_map_rgb(255, 255, 255),
-							draw_x + 32, draw_y + 12, ALLEGRO_ALIGN_CENTER,
-							"%d/%d", 7, tile
-						);
-					}
-				}
-			}
+		place_sprite(layer, gfx_w, gfx_h, draw_x, draw_y);
 
-			--y;
-			++x;
-		}
-	}
+		// Sprites that don't have a size yet are left for the main thread
+		if (gfx_w > 0 && gfx_h > 0
+		 && ((draw_x + gfx_w) < region_x1 || (draw_y + gfx_h) < region_y1 || draw_x >= region_x2 || draw_y >= region_y2))
+			return;
 
-	if (this->show_layers[11])
-	{
-		a5::Color tint = a5::RGBA(255, 255, 255, 128);
+		cmds.push_back({gfx, tile_x, tile_y, tile, (unsigned char)layer});
+	};
 
-		a5::Bitmap& gfx = this->gfxloader.LoadRaw("/outline.bmp");
-		int gfx_w = gfx.Width();
-		int gfx_h = gfx.Height();
+	for_each_visible_tile(vis, map->width, map->height, [&](int x, int y)
+	{
+		if (this->show_layers[7])
+			add(list.shadows, x, y, 7);
 
-		for (int ii = 0; ii <= map->width + map->height; ++ii)
+		for (int i : object_layers)
 		{
-			int x, y;
-			if (ii < map->height)
-			{
-				x = 0;
-				y = ii;
-			}
-			else
-			{
-				x = ii - map->height;
-				y = map->height;
-			}
+			if (this->show_layers[i])
+				add(list.objects, x, y, i);
+		}
 
-			while (y >= 0 && x <= map->width)
-			{
-				int draw_x = (x << 5) - (y << 5) - ((int(gfx_w) >> 1) - 32) - xoff;
-				int draw_y = (x << 4) + (y << 4) - yoff;
+		if (this->show_layers[8])
+			add(list.roofs, x, y, 8);
+	});
+}
 
-				if ((draw_x + gfx_w) >= 0 && (draw_y + gfx_h) >= 0 && draw_x < target_w && draw_y < target_h)
-				{
-					this->target.BlitTinted(gfx, tint, draw_x, draw_y);
-				}
+void Map_Renderer::OrderBatch(a5::Rectangle region)
+{
+	if (batch.size() < 2)
+		return;
 
-				--y;
-				++x;
-			}
-		}
-	}
+	// Every sprite gets a level one higher than any earlier sprite it may
+	// overlap, found from a coarse grid over the region. Sprites on the
+	// same level can't overlap, so they can be drawn in any order.
+	int cells_w = (region.x2 - region.x1) / batch_cell_size + 1;
+	int cells_h = (region.y2 - region.y1) / batch_cell_size + 1;
+
+	batch_cells.assign(cells_w * cells_h, -1);
 
-	for (int ii = 0; ii <= map->width + map->height; ++ii)
+	auto cell_x = [&](int x) { return std::min(std::max((x - region.x1) / batch_cell_size, 0), cells_w - 1); };
+	auto cell_y = [&](int y) { return std::min(std::max((y - region.y1) / batch_cell_size, 0), cells_h - 1); };
+
+	int max_level = 0;
+
+	for (Batched_Draw& draw : batch)
 	{
-		int x, y;
-		if (ii < map->height)
+		int cx1 = cell_x(draw.x);
+		int cy1 = cell_y(draw.y);
+		int cx2 = cell_x(draw.x + draw.w - 1);
+		int cy2 = cell_y(draw.y + draw.h - 1);
+
+		int level = 0;
+
+		for (int cy = cy1; cy <= cy2; ++cy)
 		{
-			x = 0;
-			y = ii;
+			for (int cx = cx1; cx <= cx2; ++cx)
+				level = std::max(level, batch_cells[cy * cells_w + cx] + 1);
 		}
-		else
+
+		for (int cy = cy1; cy <= cy2; ++cy)
 		{
-			x = ii - map->height;
-			y = map->height;
+			for (int cx = cx1; cx <= cx2; ++cx)
+				batch_cells[cy * cells_w + cx] = level;
 		}
 
-		while (y >= 0 && x <= map->width)
+		draw.level = level;
+		max_level = std::max(max_level, level);
+	}
+
+	// Sort by level, keeping painter's order within each level
+	batch_levels.assign(max_level + 2, 0);
+
+	for (const Batched_Draw& draw : batch)
+		++batch_levels[draw.level + 1];
+
+	for (int level = 1; level <= max_level + 1; ++level)
+		batch_levels[level] += batch_levels[level - 1];
+
+	batch_sorted.resize(batch.size());
+
+	for (const Batched_Draw& draw : batch)
+		batch_sorted[batch_levels[draw.level]++] = draw;
+
+	// Then by page within each level, starting with the page the last
+	// level finished on
+	ALLEGRO_BITMAP* last_page = nullptr;
+	auto begin = batch_sorted.begin();
+
+	for (int level = 0; level <= max_level; ++level)
+	{
+		auto end = batch_sorted.begin() + batch_levels[level];
+
+		auto rest = std::stable_partition(begin, end, [last_page](const Batched_Draw& draw)
 		{
-			for (int i : {6, 1, 3, 4, 2, 5})
-			{
-				int xoff = xoff_map[i] - this->xoff;
-				int yoff = yoff_map[i] - this->yoff;
-				short tile = map_flat[y * ((map->width+1) * 9) + (x * 9) + i];
+			return draw.page == last_page;
+		});
 
-				if (tile >= 0)
-				{
-					a5::Bitmap& gfx = this->gfxloader.Load(file_map[i], tile, animation_state);
-					int gfx_w = gfx.Width();
-					int gfx_h = gfx.Height();
-					int draw_x = xoff + (x * 32) - (y * 32);
-					int draw_y = yoff + (x * 16) + (y * 16);
-
-					if (i == 1 || i == 2)
-						draw_x -= gfx_w / 2 - 32;
-
-					draw_y -= gfx_h - 32;
-
-					if ((draw_x + gfx_w) >= 0 && (draw_y + gfx_h) >= 0 && draw_x < target_w && draw_y < target_h)
-					{
-						this->target.Blit(gfx, draw_x, draw_y);
-
-						if (this->gfxloader.IsError(gfx))
-						{
-							al_draw_textf(
-								font, al_map_rgb(255, 255, 255),
-								draw_x + 32, draw_y + 12, ALLEGRO_ALIGN_CENTER,
-								"%d/%d", i, tile
-							);
-						}
-					}
-				}
-			}
+		std::stable_sort(rest, end, [](const Batched_Draw& a, const Batched_Draw& b)
+		{
+			return std::less<ALLEGRO_BITMAP*>()(a.page, b.page);
+		});
 
-			--y;
-			++x;
-		}
+		if (begin != end)
+			last_page = (end - 1)->page;
+
+		begin = end;
 	}
 
-	for (int ii = 0; ii <= map->width + map->height; ++ii)
+	batch.swap(batch_sorted);
+}
+
+void Map_Renderer::ResetChunks()
+{
+	chunks_w = (map->width + chunk_tiles) / chunk_tiles;
+	chunks_h = (map->height + chunk_tiles) / chunk_tiles;
+
+	chunks.clear();
+	chunks.resize(chunks_w * chunks_h);
+
+	chunks_fill_tile = map->fill_tile;
+	chunks_show_ground = this->show_layers[0];
+}
+
+void Map_Renderer::LoadSpecSprites()
+{
+	a5::Bitmap& generic = this->gfxloader.LoadRaw("/specs/generic.bmp");
+
+	for (int i = 0; i < num_spec_sprites; ++i)
 	{
-		int x, y;
-		if (ii < map->height)
+		try
 		{
-			x = 0;
-			y = ii;
+			spec_sprites[i] = &this->gfxloader.LoadRaw(tiles_spec[0][i]);
 		}
-		else
+		catch (a5::Bitmap::Load_Failed &e)
 		{
-			x = ii - map->height;
-			y = map->height;
+			spec_sprites[i] = &generic;
 		}
+	}
 
-		while (y >= 0 && x <= map->width)
-		{
-			int xoff = xoff_map[8] - this->xoff;
-			int yoff = yoff_map[8] - this->yoff;
-			short tile = map_flat[y * ((map->width + 1) * 9) + (x * 9) + 8];
-			if (tile >= 0)
-			{
-				a5::Bitmap& gfx = this->gfxloader.Load(file_map[8], tile, animation_state);
-				int gfx_w = gfx.Width();
-				int gfx_h = gfx.Height();
-				int draw_x = xoff + (x * 32) - (y * 32);
-				int draw_y = yoff + (x * 16) + (y * 16);
+	spec_sprites[num_spec_sprites] = &generic;
+}
+
+a5::Bitmap& Map_Renderer::ResolveSprite(int file, int id)
+{
+	a5::Bitmap& gfx = this->gfxloader.Load(file, id, animation_state);
 
-				draw_x -= gfx_w / 2 - 32;
-				draw_y -= gfx_h - 32;
+	// Placeholders are returned when the load budget runs out, so they
+	// have to be looked up again next time
+	if (id >= 0 && !this->gfxloader.IsPlaceholder(gfx))
+	{
+		std::vector<a5::Bitmap*>& file_sprites = sprites[file];
 
-				if ((draw_x + gfx_w) >= 0 && (draw_y + gfx_h) >= 0 && draw_x < target_w && draw_y < target_h)
-				{
-					this->target.Blit(gfx, draw_x, draw_y);
-				}
-			}
+		if (std::size_t(id) >= file_sprites.size())
+			file_sprites.resize(id + 1, nullptr);
 
-			--y;
-			++x;
-		}
+		file_sprites[id] = &gfx;
 	}
 
-	if (this->show_layers[10] || highlight_spec)
-	{
-		a5::Color tint = a5::RGBA(255, 255, 255, 64);
+	return gfx;
+}
 
-		for (std::vector<EO_Map::Tile_Row>::iterator i = map->tilerows.begin(); i != map->tilerows.end(); ++i)
-		{
-			for (std::vector<EO_Map::Tile>::iterator ii = i->tiles.begin(); ii != i->tiles.end(); ++ii)
-			{
-			    a5::Bitmap& gfx = [&]() -> a5::Bitmap&
-				{
-					try
-					{
-						return this->gfxloader.LoadRaw("/specs/" + util::to_string(int(ii->spec)) + ".bmp");
-					}
-					catch (a5::Bitmap::Load_Failed &e)
-					{
-						return this->gfxloader.LoadRaw("/specs/generic.bmp");
-					}
-				}();
-				int gfx_w = gfx.Width();
-				int gfx_h = gfx.Height();
+void Map_Renderer::DrawGroundTile(a5::Bitmap& dest, short tile, int draw_x, int draw_y)
+{
+	a5::Bitmap& gfx = this->Sprite(3, tile);
 
-				int draw_x = (ii->x << 5) - (i->y << 5) - ((int(gfx_w) >> 1) - 32) - xoff;
-				int draw_y = (ii->x << 4) + (i->y << 4) - yoff;
+	dest.Blit(gfx, draw_x, draw_y);
 
-				if ((draw_x + gfx_w) >= 0 && (draw_y + gfx_h) >= 0 && draw_x < target_w && draw_y < target_h)
-				{
-					this->target.BlitTinted(gfx, tint, draw_x, draw_y);
-				}
-			}
-		}
+	if (this->gfxloader.IsError(gfx))
+	{
+		al_draw_textf(
+			font, al_map_rgb(255, 255, 255),
+			draw_x + 32, draw_y + 12, ALLEGRO_ALIGN_CENTER,
+			"%d/%d", 0, tile
+		);
 	}
+}
 
-	if (this->show_layers[9] || highlight_spec)
+void Map_Renderer::RenderChunk(int cx, int cy, Chunk& chunk)
+{
+	int dummy_frames = this->gfxloader.dummy_frames_loaded;
+
+	int origin_x = (cx - cy) * chunk_tiles * 32 - (chunk_tiles - 1) * 32;
+	int origin_y = (cx + cy) * chunk_tiles * 16;
+
+	if (!chunk.ground)
+		chunk.ground = std::make_unique<a5::Bitmap>(chunk_width, chunk_height);
+
+	chunk.animated_tiles.clear();
+	chunk.animated_frame = -1;
+
+	chunk.ground->Target();
+	al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+
+	int x1 = cx * chunk_tiles;
+	int y1 = cy * chunk_tiles;
+	int x2 = std::min((cx + 1) * chunk_tiles - 1, int(map->width));
+	int y2 = std::min((cy + 1) * chunk_tiles - 1, int(map->height));
+
+	// Tiles are drawn a diagonal at a time, as the full map is, so that any
+	// overlap between them comes out the same
+	for (int diag = x1 + y1; diag <= x2 + y2; ++diag)
 	{
-        for (std::vector<EO_Map::Warp_Row>::iterator i = map->warprows.begin(); i != map->warprows.end(); ++i)
+		for (int x = std::max(x1, diag - y2); x <= std::min(x2, diag - y1); ++x)
 		{
-			for (std::vector<EO_Map::Warp>::iterator ii = i->tiles.begin(); ii != i->tiles.end(); ++ii)
+			int y = diag - x;
+			short tile = this->show_layers[0] ? GridTile(x, y, 0) : -1;
+
+			if (tile < 0)
+				tile = map->fill_tile;
+
+			if (is_animated(3, this->gfxloader.Info(3, tile).width))
 			{
-			    //gfxid = map->GetTileSpec(ii->x, i->y) == 9 ? 41 : 39;
-                int object = map->GetObject(ii->x, i->y);
-
-                int xoff1 = 0 - this->xoff;
-                int yoff1 = 0 - this->yoff -12;
-
-                if (object != -1)
-                {
-                    a5::Bitmap& obj = this->gfxloader.Load(4, object, 0);
-                    yoff1 -= obj.Height();
-                    yoff1 += 22;
-                }
-
-                int x, y;
-                x = ii->x;
-                y = i->y;
-                a5::Bitmap& gfx = this->gfxloader.LoadRaw(tiles_spec[0][ii->door == EO_Map::HasDoor ? 45 : (ii->door == EO_Map::NoDoor ? 44 : 46)]);
-				int gfx_w = gfx.Width();
-				int gfx_h = gfx.Height();
-                int draw_x = xoff1 + (x << 5) - (y << 5) - ((gfx_w >> 1) - 32);
-                int draw_y = yoff1 + (x << 4) + (y << 4) - (gfx_h - 32);
+				chunk.animated_tiles.push_back({
+					static_cast<unsigned char>(x),
+					static_cast<unsigned char>(y),
+					tile
+				});
 
-                if ((draw_x + gfx_w) >= 0 && (draw_y + gfx_h) >= 0 && draw_x < target_w && draw_y < target_h)
-                {
-                    this->target.BlitTinted(gfx, a5::RGBA(255, 255, 255, 128), draw_x, draw_y);
-                }
+				continue;
 			}
-        }
+
+			int draw_x = (x << 5) - (y << 5) - origin_x;
+			int draw_y = (x << 4) + (y << 4) - origin_y;
+
+			this->DrawGroundTile(*chunk.ground, tile, draw_x, draw_y);
+		}
 	}
 
-	if (this->show_layers[9] || highlight_spec)
-	{
-        for (std::vector<EO_Map::Chest>::iterator i = map->chests.begin(); i != map->chests.end(); ++i)
-        {
-            //gfxid = map->GetTileSpec(i->x, i->y) == 9 ? 41 : 39;
-            int object = map->GetObject(i->x, i->y);
+	if (chunk.animated_tiles.empty())
+		chunk.animated.reset();
 
-			int xoff1 = 0 - this->xoff;
-            int yoff1 = 0 - this->yoff -12;
+	// Re-render next frame if any tiles were placeholders
+	chunk.dirty = (this->gfxloader.dummy_frames_loaded != dummy_frames);
+}
 
-            if (object != -1)
-            {
-                a5::Bitmap& obj = this->gfxloader.Load(4, object, 0);
-                yoff1 -= obj.Height();
-                yoff1 += 22;
-            }
+void Map_Renderer::RenderChunkAnimation(int cx, int cy, Chunk& chunk)
+{
+	int dummy_frames = this->gfxloader.dummy_frames_loaded;
 
-            if (map->GetWarpTile(i->x, i->y)) { yoff1 -= 25; }
+	int origin_x = (cx - cy) * chunk_tiles * 32 - (chunk_tiles - 1) * 32;
+	int origin_y = (cx + cy) * chunk_tiles * 16;
 
-			int x, y;
-			x = i->x;
-			y = i->y;
-			a5::Bitmap&gfx = this->gfxloader.LoadRaw(tiles_spec[0][map->GetTileSpec(i->x, i->y) == 9 ? 43 : 41]);
-			int gfx_w = gfx.Width();
-			int gfx_h = gfx.Height();
-			int draw_x = xoff1 + (x << 5) - (y << 5) - ((int(gfx_w) >> 1) - 32);
-			int draw_y = yoff1 + (x << 4) + (y << 4) - (int(gfx_h) - 32);
+	if (!chunk.animated)
+		chunk.animated = std::make_unique<a5::Bitmap>(chunk_width, chunk_height);
 
-            if ((draw_x + gfx_w) >= 0 && (draw_y + gfx_h) >= 0 && draw_x < target_w && draw_y < target_h)
-            {
-                this->target.BlitTinted(gfx, a5::RGBA(255, 255, 255, 128), draw_x, draw_y);
-            }
-        }
-	}
+	chunk.animated->Target();
+	al_clear_to_color(al_map_rgba(0, 0, 0, 0));
 
-	if (this->show_layers[9] || highlight_spec)
+	for (const Chunk::Animated_Tile& anim_tile : chunk.animated_tiles)
 	{
-        for (std::vector<EO_Map::Sign>::iterator i = map->signs.begin(); i != map->signs.end(); ++i)
-        {
-            int object = map->GetObject(i->x, i->y);
+		int draw_x = (anim_tile.x << 5) - (anim_tile.y << 5) - origin_x;
+		int draw_y = (anim_tile.x << 4) + (anim_tile.y << 4) - origin_y;
 
-			int xoff1 = 0 - this->xoff;
-            int yoff1 = 0 - this->yoff -12;
+		this->DrawGroundTile(*chunk.animated, anim_tile.tile, draw_x, draw_y);
+	}
 
-            if (object != -1)
-            {
-                a5::Bitmap& obj = this->gfxloader.Load(4, object, 0);
-                yoff1 -= obj.Height();
-                yoff1 += 22;
-            }
+	if (this->gfxloader.dummy_frames_loaded == dummy_frames)
+		chunk.animated_frame = animation_state;
+	else
+		chunk.animated_frame = -1;
+}
 
-            if (map->GetWarpTile(i->x, i->y))           { yoff1 -= 25; }
-            if (map->GetChestSpawns(i->x, i->y).size()) { yoff1 -= 25; }
+int Map_Renderer::MaxCachedChunks(int view_w, int view_h)
+{
+	// Chunks are diamonds chunk_tiles * 64 wide and chunk_tiles * 32 high,
+	// offset by half of that from their neighbours
+	int across = view_w / (chunk_tiles * 64) + 2;
+	int down = view_h / (chunk_tiles * 32) + 2;
+	int per_screen = across * down * 2;
 
-			int x, y;
-			x = i->x;
-			y = i->y;
-			a5::Bitmap&gfx = this->gfxloader.LoadRaw(tiles_spec[0][42]);
-			int gfx_w = gfx.Width();
-			int gfx_h = gfx.Height();
-			int draw_x = xoff1 + (x << 5) - (y << 5) - ((gfx_w >> 1) - 32);
-			int draw_y = yoff1 + (x << 4) + (y << 4) - (gfx_h - 32);
+	std::size_t chunk_bytes = std::size_t(chunk_width) * chunk_height * 4 * 2;
+	int by_memory = int(max_chunk_cache_bytes / chunk_bytes);
 
-            if ((draw_x + gfx_w) >= 0 && (draw_y + gfx_h) >= 0 && draw_x < target_w && draw_y < target_h)
-            {
-                this->target.BlitTinted(gfx, a5::RGBA(255, 255, 255, 128), draw_x, draw_y);
-            }
-        }
-	}
+	return std::min(per_screen * 2, by_memory);
+}
+
+void Map_Renderer::EvictChunks()
+{
+	if (rendering_lod_tile)
+		return;
+
+	std::vector<Chunk*> cached;
 
-    if (this->show_layers[9] || highlight_spec)
+	for (Chunk& chunk : chunks)
 	{
-        for (std::vector<EO_Map::NPC>::iterator i = map->npcs.begin(); i != map->npcs.end(); ++i)
-        {
-            int object = map->GetObject(i->x, i->y);
+		if (chunk.ground && chunk.last_used != frame_counter)
+			cached.push_back(&chunk);
+	}
 
-			int xoff1 = 0 - this->xoff;
-            int yoff1 = 0 - this->yoff -12;
+	int excess = int(cached.size()) - max_cached_chunks;
 
-            if (object != -1)
-            {
-                a5::Bitmap& obj = this->gfxloader.Load(4, object, 0);
-                yoff1 -= obj.Height();
-                yoff1 += 22;
-            }
+	if (excess <= 0)
+		return;
 
-            if (map->GetWarpTile(i->x, i->y))           { yoff1 -= 25; }
-            if (map->GetChestSpawns(i->x, i->y).size()) { yoff1 -= 25; }
-            if (map->GetSign(i->x, i->y))               { yoff1 -= 25; }
+	std::sort(cached.begin(), cached.end(), [](Chunk* a, Chunk* b)
+	{
+		return a->last_used < b->last_used;
+	});
 
-			int x, y;
-			x = i->x;
-			y = i->y;
-			a5::Bitmap&gfx = this->gfxloader.LoadRaw(tiles_spec[0][47]);
-			int gfx_w = gfx.Width();
-			int gfx_h = gfx.Height();
-			int draw_x = xoff1 + (x << 5) - (y << 5) - ((gfx_w >> 1) - 32);
-			int draw_y = yoff1 + (x << 4) + (y << 4) - (gfx_h - 32);
+	for (int i = 0; i < excess; ++i)
+	{
+		cached[i]->ground.reset();
+		cached[i]->animated.reset();
+		cached[i]->animated_frame = -1;
+		cached[i]->dirty = true;
+	}
+}
 
-            if ((draw_x + gfx_w) >= 0 && (draw_y + gfx_h) >= 0 && draw_x < target_w && draw_y < target_h)
-            {
-                this->target.BlitTinted(gfx, a5::RGBA(255, 255, 255, 128), draw_x, draw_y);
-            }
-        }
+Map_Renderer::Visible_Tiles Map_Renderer::VisibleTiles(a5::Rectangle region)
+{
+	// Sprites are anchored to the top-left of their tile, but can extend
+	// past it: objects grow upwards and to either side, the spec and
+	// entity bubbles sit above their tile, and shadows hang down from it
+	int pad_x = 64;
+	int pad_top = 64;
+	int pad_bottom = 64;
+
+	for (int file : {3, 4, 5, 6, 7, 22})
+	{
+		pad_x = std::max(pad_x, this->gfxloader.MaxWidth(file) + 32);
+		pad_bottom = std::max(pad_bottom, this->gfxloader.MaxHeight(file) + 128);
 	}
+
+	pad_top = std::max({pad_top, this->gfxloader.MaxHeight(3), this->gfxloader.MaxHeight(22)});
+
+	Visible_Tiles vis;
+
+	vis.diag_min = floor_div(region.y1 + this->yoff - pad_top, 16);
+	vis.diag_max = floor_div(region.y2 + this->yoff + pad_bottom, 16) + 1;
+	vis.col_min = floor_div(region.x1 + this->xoff - pad_x, 32);
+	vis.col_max = floor_div(region.x2 + this->xoff + pad_x, 32) + 1;
+
+	vis.diag_min = std::max(vis.diag_min, 0);
+	vis.diag_max = std::min(vis.diag_max, map->width + map->height);
+
+	return vis;
 }
 
-void Map_Renderer::RebuildTarget(int w, int h)
+void Map_Renderer::RedrawRect(const Animated_Rect& rect)
 {
-	auto tmp = al_get_new_bitmap_flags();
-	al_set_new_bitmap_flags(tmp | ALLEGRO_MIN_LINEAR | ALLEGRO_MAG_LINEAR | ALLEGRO_MIPMAP);
-	target = a5::Bitmap(w, h);
-	al_set_new_bitmap_flags(tmp);
+	int clip_x, clip_y, clip_w, clip_h;
+	al_get_clipping_rectangle(&clip_x, &clip_y, &clip_w, &clip_h);
+
+	// Held sprites have to be flushed before the clipping rectangle moves
+	bool held = al_is_bitmap_drawing_held();
+
+	if (held)
+		al_hold_bitmap_drawing(false);
+
+	al_set_clipping_rectangle(rect.x1, rect.y1, rect.x2 - rect.x1, rect.y2 - rect.y1);
+	this->target.Clear();
+
+	if (held)
+		al_hold_bitmap_drawing(true);
+
+	this->RenderRegion(a5::Rectangle(rect.x1, rect.y1, rect.x2, rect.y2));
+
+	if (held)
+		al_hold_bitmap_drawing(false);
+
+	al_set_clipping_rectangle(clip_x, clip_y, clip_w, clip_h);
+
+	if (held)
+		al_hold_bitmap_drawing(true);
+}
+
+void Map_Renderer::ScrollFrame(int dx, int dy)
+{
+	bool held = al_is_bitmap_drawing_held();
+
+	if (held)
+		al_hold_bitmap_drawing(false);
+
+	this->back_target.Target();
+	this->back_target.Clear();
+	this->back_target.Blit(this->target, -dx, -dy);
+	std::swap(this->target, this->back_target);
+	this->target.Target();
+
+	if (held)
+		al_hold_bitmap_drawing(true);
+
+	int target_w = this->target.Width();
+	int target_h = this->target.Height();
+
+	std::vector<Animated_Rect> shifted_rects;
+
+	for (const Animated_Rect& rect : animated_rects)
+	{
+		Animated_Rect shifted = {rect.x1 - dx, rect.y1 - dy, rect.x2 - dx, rect.y2 - dy};
+
+		if (shifted.x2 > 0 && shifted.y2 > 0 && shifted.x1 < target_w && shifted.y1 < target_h)
+			shifted_rects.push_back(shifted);
+	}
+
+	animated_rects = std::move(shifted_rects);
+}
+
+void Map_Renderer::MergeAnimatedRects()
+{
+	int target_w = this->target.Width();
+	int target_h = this->target.Height();
+
+	// Sprites crossing a scroll seam get recorded again by each strip
+	std::sort(animated_rects.begin(), animated_rects.end());
+	animated_rects.erase(std::unique(animated_rects.begin(), animated_rects.end()), animated_rects.end());
+
+	// Animated sprites are gathered in to blocks so that a screen full of
+	// water doesn't turn in to hundreds of tiny redraws
+	static constexpr int block_size = 64;
+
+	int blocks_w = (target_w + block_size - 1) / block_size;
+	int blocks_h = (target_h + block_size - 1) / block_size;
+	std::vector<bool> blocks(blocks_w * blocks_h);
+
+	for (const Animated_Rect& rect : animated_rects)
+	{
+		int x1 = std::max(rect.x1, 0);
+		int y1 = std::max(rect.y1, 0);
+		int x2 = std::min(rect.x2, target_w);
+		int y2 = std::min(rect.y2, target_h);
+
+		if (x1 >= x2 || y1 >= y2)
+			continue;
+
+		for (int by = y1 / block_size; by <= (y2 - 1) / block_size; ++by)
+			for (int bx = x1 / block_size; bx <= (x2 - 1) / block_size; ++bx)
+				blocks[by * blocks_w + bx] = true;
+	}
+
+	animated_blocks.clear();
+
+	for (int by = 0; by < blocks_h; ++by)
+	{
+		for (int bx = 0; bx < blocks_w; ++bx)
+		{
+			if (!blocks[by * blocks_w + bx])
+				continue;
+
+			int run_start = bx;
+
+			while (bx + 1 < blocks_w && blocks[by * blocks_w + bx + 1])
+				++bx;
+
+			animated_blocks.push_back({
+				run_start * block_size, by * block_size,
+				std::min((bx + 1) * block_size, target_w), std::min((by + 1) * block_size, target_h)
+			});
+		}
+	}
+}
+
+bool Map_Renderer::BeginStats()
+{
+	if (!this->stats.BeginFrame())
+		return false;
+
+	stats_load_hits = this->gfxloader.load_hits;
+	stats_load_misses = this->gfxloader.load_misses;
+
+	return true;
+}
+
+void Map_Renderer::EndStats()
+{
+	this->stats.Count(Render_Stats::LoaderHits, this->gfxloader.load_hits - stats_load_hits);
+	this->stats.Count(Render_Stats::LoaderMisses, this->gfxloader.load_misses - stats_load_misses);
+	this->stats.Count(Render_Stats::DummyFrames, this->gfxloader.dummy_frames_loaded);
+	this->stats.EndFrame();
+}
+
+void Map_Renderer::Render()
+{
+	this->BeginStats();
+	++frame_counter;
+
+	if (this->LodActive())
+	{
+		this->RenderLod();
+		this->WarmUp();
+		this->EndStats();
+		return;
+	}
+
+	int target_w = this->target.Width();
+	int target_h = this->target.Height();
+
+	int dx = this->xoff - frame_xoff;
+	int dy = this->yoff - frame_yoff;
+
+	// Jumps to somewhere else on the map aren't movement
+	if (std::abs(dx) >= target_w || std::abs(dy) >= target_h)
+		dx = dy = 0;
+
+	velocity_x = (velocity_x + dx) * 0.5f;
+	velocity_y = (velocity_y + dy) * 0.5f;
+
+	bool full_redraw = !frame_valid
+	                || std::abs(dx) >= target_w || std::abs(dy) >= target_h
+	                || frame_fill_tile != map->fill_tile
+	                || frame_highlight_spec != highlight_spec
+	                || !std::equal(std::begin(show_layers), std::end(show_layers), std::begin(frame_show_layers));
+
+	recording_animation = true;
+
+	if (full_redraw)
+	{
+		animated_rects.clear();
+		this->RedrawRect({0, 0, target_w, target_h});
+	}
+	else if (dx != 0 || dy != 0)
+	{
+		// Keep what's still on screen and only draw the strips uncovered
+		// by the scroll, clipped so sprites crossing the seam line up
+		this->ScrollFrame(dx, dy);
+
+		if (dy > 0)
+			this->RedrawRect({0, target_h - dy, target_w, target_h});
+		else if (dy < 0)
+			this->RedrawRect({0, 0, target_w, -dy});
+
+		int strip_y1 = std::max(0, -dy);
+		int strip_y2 = std::min(target_h, target_h - dy);
+
+		if (dx > 0)
+			this->RedrawRect({target_w - dx, strip_y1, target_w, strip_y2});
+		else if (dx < 0)
+			this->RedrawRect({0, strip_y1, -dx, strip_y2});
+	}
+
+	recording_animation = false;
+
+	this->MergeAnimatedRects();
+
+	frame_xoff = this->xoff;
+	frame_yoff = this->yoff;
+	frame_fill_tile = map->fill_tile;
+	frame_highlight_spec = highlight_spec;
+	std::copy(std::begin(show_layers), std::end(show_layers), std::begin(frame_show_layers));
+
+	// The kept part of the frame may be showing an older animation frame
+	if (!full_redraw && frame_animation_state != animation_state)
+		this->RenderAnimation();
+
+	frame_animation_state = animation_state;
+
+	// Placeholders have to be drawn over once their sprites are loaded
+	frame_valid = (this->gfxloader.dummy_frames_loaded == 0);
+
+	this->WarmUp();
+	this->Prefetch();
+
+	this->EndStats();
+}
+
+void Map_Renderer::BuildWarmUp()
+{
+	struct Usage
+	{
+		int distance;
+		int count;
+	};
+
+	std::map<std::pair<int, int>, Usage> usage;
+
+	int view_w = this->ViewWidth();
+	int view_h = this->ViewHeight();
+
+	for (int y = 0; y <= map->height; ++y)
+	{
+		for (int x = 0; x <= map->width; ++x)
+		{
+			// Distance of the tile outside of the view, in whole tiles so
+			// that usage decides the order among nearby sprites
+			int draw_x = (x - y) * 32 - this->xoff;
+			int draw_y = (x + y) * 16 - this->yoff;
+			int out_x = std::max({0, -draw_x - 64, draw_x - view_w});
+			int out_y = std::max({0, -draw_y - 32, draw_y - view_h});
+			int distance = std::max(out_x / 64, out_y / 32);
+
+			for (int layer = 0; layer < 9; ++layer)
+			{
+				short tile = GridTile(x, y, layer);
+
+				if (layer == 0 && tile < 0)
+					tile = map->fill_tile;
+
+				if (tile <= 0)
+					continue;
+
+				auto result = usage.insert({{file_map[layer], tile}, {distance, 0}});
+				Usage& used = result.first->second;
+				used.distance = std::min(used.distance, distance);
+				++used.count;
+			}
+		}
+	}
+
+	std::vector<std::pair<Usage, Warm_Up_Sprite>> order;
+	order.reserve(usage.size());
+
+	for (auto&& entry : usage)
+		order.push_back({entry.second, {entry.first.first, static_cast<short>(entry.first.second)}});
+
+	std::sort(order.begin(), order.end(), [](const std::pair<Usage, Warm_Up_Sprite>& a, const std::pair<Usage, Warm_Up_Sprite>& b)
+	{
+		if (a.first.distance != b.first.distance)
+			return a.first.distance < b.first.distance;
+
+		return a.first.count > b.first.count;
+	});
+
+	warmup_sprites.clear();
+	warmup_loaded = 0;
+
+	for (auto&& entry : order)
+		warmup_sprites.push_back(entry.second);
+}
+
+void Map_Renderer::WarmUp()
+{
+	if (warmup_started)
+	{
+		warmup_started = false;
+		warmup_sprites.clear();
+		warmup_loaded = 0;
+
+		if (!map || map->width <= 0 || map->height <= 0)
+			return;
+
+		if (tile_grid_dirty)
+		{
+			this->RebuildTileGrid();
+			this->ResetChunks();
+		}
+
+		this->BuildWarmUp();
+
+		// Everything is queued once, in order, for the decode threads.
+		// Without them this loads what the load time allows.
+		for (const Warm_Up_Sprite& sprite : warmup_sprites)
+			this->gfxloader.Prefetch(sprite.file, sprite.id, false);
+	}
+
+	if (warmup_loaded >= warmup_sprites.size())
+		return;
+
+	this->gfxloader.UploadDecoded();
+
+	// Sprites finish roughly in the order they were queued, so only the
+	// first one not yet loaded is checked, and asked for again in case it
+	// was dropped by a Reset or there are no decode threads
+	while (warmup_loaded < warmup_sprites.size())
+	{
+		const Warm_Up_Sprite& sprite = warmup_sprites[warmup_loaded];
+
+		if (!this->gfxloader.Loaded(sprite.file, sprite.id))
+		{
+			this->gfxloader.Prefetch(sprite.file, sprite.id, false);
+
+			if (!this->gfxloader.Loaded(sprite.file, sprite.id))
+				break;
+		}
+
+		++warmup_loaded;
+	}
+}
+
+void Map_Renderer::Prefetch()
+{
+	// Anything queued for a direction the view is no longer moving in is
+	// cancelled after a round without being asked for again
+	this->gfxloader.BeginPrefetch();
+
+	if (!map || tile_grid_dirty || tile_grid.empty())
+		return;
+
+	int target_w = this->target.Width();
+	int target_h = this->target.Height();
+
+	auto margin = [](float velocity)
+	{
+		return std::min(int(std::abs(velocity) * prefetch_frames), max_prefetch_margin);
+	};
+
+	int margin_x = margin(velocity_x);
+	int margin_y = margin(velocity_y);
+
+	auto prefetch_region = [&](a5::Rectangle region)
+	{
+		Visible_Tiles vis = this->VisibleTiles(region);
+
+		for_each_visible_tile(vis, map->width, map->height, [&](int x, int y)
+		{
+			for (int layer = 0; layer < 9; ++layer)
+			{
+				short tile = this->show_layers[layer] ? GridTile(x, y, layer) : -1;
+
+				if (layer == 0 && tile < 0)
+					tile = map->fill_tile;
+
+				if (tile > 0)
+					this->gfxloader.Prefetch(file_map[layer], tile);
+			}
+		});
+	};
+
+	if (margin_x > 0)
+	{
+		if (velocity_x > 0)
+			prefetch_region(a5::Rectangle(target_w, 0, target_w + margin_x, target_h));
+		else
+			prefetch_region(a5::Rectangle(-margin_x, 0, 0, target_h));
+	}
+
+	if (margin_y > 0)
+	{
+		if (velocity_y > 0)
+			prefetch_region(a5::Rectangle(0, target_h, target_w, target_h + margin_y));
+		else
+			prefetch_region(a5::Rectangle(0, -margin_y, target_w, 0));
+	}
+
+	this->gfxloader.UploadDecoded();
+}
+
+void Map_Renderer::RenderAnimation()
+{
+	// LOD tiles keep whichever animation frame they were rendered with
+	if (this->LodActive())
+		return;
+
+	// Also called by Render, which is already counting the frame
+	bool new_frame = this->BeginStats();
+
+	if (new_frame)
+		++frame_counter;
+
+	for (const Animated_Rect& rect : animated_blocks)
+		this->RedrawRect(rect);
+
+	frame_animation_state = animation_state;
+
+	if (this->gfxloader.dummy_frames_loaded != 0)
+		frame_valid = false;
+
+	if (new_frame)
+		this->EndStats();
+}
+
+void Map_Renderer::RenderLodTile(const Lod_Key& key, Lod_Tile& tile)
+{
+	int tile_world = lod_tile_size << key.level;
+	int pieces = std::max(tile_world / lod_scratch_size, 1);
+	int piece_size = lod_tile_size / pieces;
+
+	auto tmp = al_get_new_bitmap_flags();
+
+	if (!tile.bmp)
+	{
+		al_set_new_bitmap_flags(tmp | ALLEGRO_MIN_LINEAR | ALLEGRO_MAG_LINEAR);
+		tile.bmp = std::make_unique<a5::Bitmap>(lod_tile_size, lod_tile_size);
+	}
+
+	// Mipmaps keep the downscale from the scratch bitmap from aliasing
+	if (!lod_scratch)
+	{
+		al_set_new_bitmap_flags(tmp | ALLEGRO_MIN_LINEAR | ALLEGRO_MAG_LINEAR | ALLEGRO_MIPMAP);
+		lod_scratch = a5::Bitmap(lod_scratch_size, lod_scratch_size);
+	}
+
+	al_set_new_bitmap_flags(tmp);
+
+	int saved_xoff = this->xoff;
+	int saved_yoff = this->yoff;
+	int dummy_frames = this->gfxloader.dummy_frames_loaded;
+
+	// The tile is drawn a scratch bitmap at a time at full size, through
+	// the normal renderer, then scaled down in to place
+	std::swap(this->target, this->lod_scratch);
+	rendering_lod_tile = true;
+
+	tile.bmp->Target();
+	tile.bmp->Clear();
+
+	for (int py = 0; py < pieces; ++py)
+	{
+		for (int px = 0; px < pieces; ++px)
+		{
+			this->xoff = key.tx * tile_world + px * lod_scratch_size;
+			this->yoff = key.ty * tile_world + py * lod_scratch_size;
+
+			this->target.Target();
+			this->target.Clear();
+
+			al_hold_bitmap_drawing(true);
+			this->RenderRegion(a5::Rectangle(0, 0, lod_scratch_size, lod_scratch_size));
+			al_hold_bitmap_drawing(false);
+
+			tile.bmp->Target();
+			tile.bmp->BlitScaled(this->target, a5::Rectangle(
+				px * piece_size, py * piece_size,
+				(px + 1) * piece_size, (py + 1) * piece_size
+			));
+		}
+	}
+
+	rendering_lod_tile = false;
+	std::swap(this->target, this->lod_scratch);
+
+	this->xoff = saved_xoff;
+	this->yoff = saved_yoff;
+
+	// Tiles showing placeholders are rendered again on a later frame
+	tile.dirty = (this->gfxloader.dummy_frames_loaded != dummy_frames);
+}
+
+void Map_Renderer::RenderLod()
+{
+	if (map->width <= 0 || map->height <= 0)
+		return;
+
+	if (lod_fill_tile != map->fill_tile
+	 || lod_highlight_spec != highlight_spec
+	 || !std::equal(std::begin(show_layers), std::end(show_layers), std::begin(lod_show_layers)))
+	{
+		lod_tiles.clear();
+		lod_fill_tile = map->fill_tile;
+		lod_highlight_spec = highlight_spec;
+		std::copy(std::begin(show_layers), std::end(show_layers), std::begin(lod_show_layers));
+	}
+
+	// The level with the smallest tiles that are still scaled down, so
+	// each frame draws about the same number of tiles at any zoom
+	int level = 1;
+
+	while (level < max_lod_level && this->zoom * (2 << level) <= 1.001f)
+		++level;
+
+	int tile_world = lod_tile_size << level;
+
+	int tx1 = floor_div(this->xoff, tile_world);
+	int ty1 = floor_div(this->yoff, tile_world);
+	int tx2 = floor_div(this->xoff + this->ViewWidth(), tile_world);
+	int ty2 = floor_div(this->yoff + this->ViewHeight(), tile_world);
+
+	++lod_frame_counter;
+	lod_pending = false;
+
+	bool held = al_is_bitmap_drawing_held();
+
+	if (held)
+		al_hold_bitmap_drawing(false);
+
+	// Missing tiles are rendered nearest the top first, until the frame's
+	// time is used up. At least one is always rendered so the view fills
+	// in even on slow machines.
+	double render_until = al_get_time() + lod_render_time;
+	bool rendered_any = false;
+
+	for (int ty = ty1; ty <= ty2; ++ty)
+	{
+		for (int tx = tx1; tx <= tx2; ++tx)
+		{
+			Lod_Key key{level, tx, ty};
+			Lod_Tile& tile = lod_tiles[key];
+			tile.last_used = lod_frame_counter;
+
+			if (!tile.dirty)
+				continue;
+
+			if (!rendered_any || al_get_time() < render_until)
+			{
+				this->RenderLodTile(key, tile);
+				rendered_any = true;
+			}
+
+			if (tile.dirty)
+				lod_pending = true;
+		}
+	}
+
+	this->EvictChunks();
+
+	this->target.Target();
+	this->target.Clear();
+
+	if (held)
+		al_hold_bitmap_drawing(true);
+
+	// Tiles which are out of date are still drawn until they're replaced
+	for (int ty = ty1; ty <= ty2; ++ty)
+	{
+		for (int tx = tx1; tx <= tx2; ++tx)
+		{
+			Lod_Tile& tile = lod_tiles[Lod_Key{level, tx, ty}];
+
+			if (!tile.bmp)
+				continue;
+
+			int x1 = std::lround((tx * tile_world - this->xoff) * this->zoom);
+			int y1 = std::lround((ty * tile_world - this->yoff) * this->zoom);
+			int x2 = std::lround(((tx + 1) * tile_world - this->xoff) * this->zoom);
+			int y2 = std::lround(((ty + 1) * tile_world - this->yoff) * this->zoom);
+
+			this->target.BlitScaled(*tile.bmp, a5::Rectangle(x1, y1, x2, y2));
+		}
+	}
+
+	this->EvictLodTiles();
+
+	// Leaving LOD mode has to redraw the whole target
+	frame_valid = false;
+}
+
+void Map_Renderer::EvictLodTiles()
+{
+	std::vector<std::map<Lod_Key, Lod_Tile>::iterator> cached;
+
+	for (auto it = lod_tiles.begin(); it != lod_tiles.end(); ++it)
+	{
+		if (it->second.last_used != lod_frame_counter)
+			cached.push_back(it);
+	}
+
+	int excess = int(lod_tiles.size()) - max_cached_lod_tiles;
+
+	if (excess <= 0)
+		return;
+
+	std::sort(cached.begin(), cached.end(), [](auto a, auto b)
+	{
+		return a->second.last_used < b->second.last_used;
+	});
+
+	excess = std::min(excess, int(cached.size()));
+
+	for (int i = 0; i < excess; ++i)
+		lod_tiles.erase(cached[i]);
+}
+
+void Map_Renderer::RenderRegion(a5::Rectangle region)
+{
+    if (map->width <= 0 || map->height <= 0) return;
+
+	if (tile_grid_dirty)
+	{
+		this->RebuildTileGrid();
+		this->ResetChunks();
+	}
+
+	int region_x1 = region.x1;
+	int region_y1 = region.y1;
+	int region_x2 = region.x2;
+	int region_y2 = region.y2;
+
+	auto in_region = [&](int x, int y, int w, int h)
+	{
+		return (x + w) >= region_x1 && (y + h) >= region_y1 && x < region_x2 && y < region_y2;
+	};
+
+	Visible_Tiles vis = this->VisibleTiles(region);
+
+	if (chunks_fill_tile != map->fill_tile || chunks_show_ground != this->show_layers[0])
+		this->ResetChunks();
+
+	// Only gfx003 and gfx006 have animated sprites
+	if (sprite_anim_state != animation_state)
+	{
+		std::fill(sprites[3].begin(), sprites[3].end(), nullptr);
+		std::fill(sprites[6].begin(), sprites[6].end(), nullptr);
+		sprite_anim_state = animation_state;
+	}
+
+	std::vector<std::pair<int, int>> visible_chunks;
+
+	for (int chunk_diag = 0; chunk_diag < chunks_w + chunks_h - 1; ++chunk_diag)
+	{
+		for (int cx = std::max(0, chunk_diag - chunks_h + 1); cx < chunks_w && cx <= chunk_diag; ++cx)
+		{
+			int cy = chunk_diag - cx;
+
+			int draw_x = (cx - cy) * chunk_tiles * 32 - (chunk_tiles - 1) * 32 - this->xoff;
+			int draw_y = (cx + cy) * chunk_tiles * 16 - this->yoff;
+
+			if (in_region(draw_x, draw_y, chunk_width, chunk_height))
+				visible_chunks.push_back({cx, cy});
+		}
+	}
+
+	std::optional<Render_Stats::Scoped_Timer> ground_timer(std::in_place, this->stats, Render_Stats::Ground);
+
+	// Chunks are rendered in to their own bitmaps before anything is drawn
+	// to the target, so held drawing doesn't have to keep being toggled
+	bool held = al_is_bitmap_drawing_held();
+
+	if (held)
+		al_hold_bitmap_drawing(false);
+
+	for (auto&& chunk_pos : visible_chunks)
+	{
+		Chunk& chunk = chunks[chunk_pos.second * chunks_w + chunk_pos.first];
+
+		if (chunk.dirty || !chunk.ground)
+			this->RenderChunk(chunk_pos.first, chunk_pos.second, chunk);
+
+		if (!chunk.animated_tiles.empty() && chunk.animated_frame != animation_state)
+			this->RenderChunkAnimation(chunk_pos.first, chunk_pos.second, chunk);
+
+		chunk.last_used = frame_counter;
+	}
+
+	this->target.Target();
+
+	if (held)
+		al_hold_bitmap_drawing(true);
+
+	for (auto&& chunk_pos : visible_chunks)
+	{
+		Chunk& chunk = chunks[chunk_pos.second * chunks_w + chunk_pos.first];
+
+		int draw_x = (chunk_pos.first - chunk_pos.second) * chunk_tiles * 32 - (chunk_tiles - 1) * 32 - this->xoff;
+		int draw_y = (chunk_pos.first + chunk_pos.second) * chunk_tiles * 16 - this->yoff;
+
+		this->target.Blit(*chunk.ground, draw_x, draw_y);
+		this->stats.Count(Render_Stats::Blits);
+
+		if (chunk.animated)
+		{
+			this->target.Blit(*chunk.animated, draw_x, draw_y);
+			this->stats.Count(Render_Stats::Blits);
+		}
+
+		if (recording_animation)
+		{
+			for (const Chunk::Animated_Tile& anim : chunk.animated_tiles)
+			{
+				int x = chunk_pos.first * chunk_tiles + anim.x;
+				int y = chunk_pos.second * chunk_tiles + anim.y;
+				int tile_x = (x - y) * 32 - this->xoff;
+				int tile_y = (x + y) * 16 - this->yoff;
+
+				if (in_region(tile_x, tile_y, 64, 32))
+					animated_rects.push_back({tile_x, tile_y, tile_x + 64, tile_y + 32});
+			}
+		}
+	}
+
+	this->EvictChunks();
+	ground_timer.reset();
+
+	// Workers each turn a band of diagonals in to draw commands, which are
+	// joined back up in band order to keep the painter's order intact
+	int diags = vis.diag_max - vis.diag_min + 1;
+	int bands = std::max(1, std::min(draw_pool.Threads() + 1, diags / min_band_diags));
+
+	if (int(draw_bands.size()) < bands)
+		draw_bands.resize(bands);
+
+	// Info loads modules the first time a file is used, which must not
+	// happen on the workers, so every file they can look at is loaded here
+	for (int layer = 1; layer < 9; ++layer)
+		this->gfxloader.Prepare(file_map[layer]);
+
+	{
+		Render_Stats::Scoped_Timer timer(this->stats, Render_Stats::DrawLists);
+
+		draw_pool.Run(bands, [&](int band)
+		{
+			Visible_Tiles band_vis = vis;
+			band_vis.diag_min = vis.diag_min + diags * band / bands;
+			band_vis.diag_max = vis.diag_min + diags * (band + 1) / bands - 1;
+
+			this->BuildDrawList(band_vis, region, draw_bands[band]);
+		});
+	}
+
+	auto submit = [&](std::vector<Draw_Command> Draw_List::*pass, Render_Stats::Pass stats_pass)
+	{
+		Render_Stats::Scoped_Timer timer(this->stats, stats_pass);
+		int culled = 0;
+		int switches = 0;
+
+		batch.clear();
+
+		for (int band = 0; band < bands; ++band)
+		{
+			for (const Draw_Command& cmd : draw_bands[band].*pass)
+			{
+				int file = file_map[cmd.layer];
+				a5::Bitmap& gfx = cmd.gfx ? *cmd.gfx : this->Sprite(file, cmd.tile);
+				int gfx_w = gfx.Width();
+				int gfx_h = gfx.Height();
+				int draw_x = cmd.x;
+				int draw_y = cmd.y;
+
+				place_sprite(cmd.layer, gfx_w, gfx_h, draw_x, draw_y);
+
+				if (!in_region(draw_x, draw_y, gfx_w, gfx_h))
+				{
+					++culled;
+					continue;
+				}
+
+				// Atlas sprites are sub-bitmaps of their page
+				ALLEGRO_BITMAP* page = al_get_parent_bitmap(gfx);
+
+				batch.push_back({&gfx, page ? page : static_cast<ALLEGRO_BITMAP*>(gfx), draw_x, draw_y, gfx_w, gfx_h, 0, cmd.tile, cmd.layer});
+			}
+		}
+
+		this->OrderBatch(region);
+
+		ALLEGRO_BITMAP* last_page = nullptr;
+
+		for (const Batched_Draw& draw : batch)
+		{
+			a5::Bitmap& gfx = *draw.gfx;
+
+			if (draw.page != last_page)
+			{
+				++switches;
+				last_page = draw.page;
+			}
+
+			if (draw.layer == 7)
+				this->target.BlitTinted(gfx, a5::RGBA(255, 255, 255, shadow_alpha), draw.x, draw.y);
+			else
+				this->target.Blit(gfx, draw.x, draw.y);
+
+			if (draw.layer != 8 && this->gfxloader.IsError(gfx))
+			{
+				al_draw_textf(
+					font, al_map_rgb(255, 255, 255),
+					draw.x + 32, draw.y + 12, ALLEGRO_ALIGN_CENTER,
+					"%d/%d", int(draw.layer), int(draw.tile)
+				);
+
+				last_page = nullptr;
+			}
+
+			if (recording_animation && is_animated(file_map[draw.layer], this->gfxloader.Info(file_map[draw.layer], draw.tile).width))
+				animated_rects.push_back({draw.x, draw.y, draw.x + draw.w, draw.y + draw.h});
+		}
+
+		this->stats.Count(Render_Stats::Blits, int(batch.size()));
+		this->stats.Count(Render_Stats::CulledSprites, culled);
+		this->stats.Count(Render_Stats::TextureSwitches, switches);
+	};
+
+	submit(&Draw_List::shadows, Render_Stats::Shadows);
+
+	if (this->show_layers[11])
+	{
+		Render_Stats::Scoped_Timer timer(this->stats, Render_Stats::Grid);
+
+		if (grid_w != map->width + 1 || grid_h != map->height + 1)
+			this->RebuildGrid();
+
+		// Lines outside of the region are clipped, and there are only a
+		// couple of them per row and column of the map
+		ALLEGRO_TRANSFORM old_transform = *al_get_current_transform();
+		ALLEGRO_TRANSFORM transform;
+		al_identity_transform(&transform);
+		al_translate_transform(&transform, -xoff, -yoff);
+		al_compose_transform(&transform, &old_transform);
+
+		bool held = al_is_bitmap_drawing_held();
+
+		if (held)
+			al_hold_bitmap_drawing(false);
+
+		al_use_transform(&transform);
+		al_draw_prim(grid_vertices.data(), nullptr, nullptr, 0, int(grid_vertices.size()), ALLEGRO_PRIM_LINE_LIST);
+		al_use_transform(&old_transform);
+
+		if (held)
+			al_hold_bitmap_drawing(true);
+	}
+
+	submit(&Draw_List::objects, Render_Stats::Objects);
+	submit(&Draw_List::roofs, Render_Stats::Roofs);
+
+	if (this->show_layers[10] || highlight_spec)
+	{
+		Render_Stats::Scoped_Timer timer(this->stats, Render_Stats::Specs);
+
+		// Drawn once over everything, at roughly the opacity that the old
+		// under-and-over pair of passes added up to
+		a5::Color tint = a5::RGBA(255, 255, 255, highlight_spec ? 208 : 112);
+
+		for (std::vector<EO_Map::Tile_Row>::iterator i = map->tilerows.begin(); i != map->tilerows.end(); ++i)
+		{
+			for (std::vector<EO_Map::Tile>::iterator ii = i->tiles.begin(); ii != i->tiles.end(); ++ii)
+			{
+				if (!vis.Contains(ii->x, i->y))
+					continue;
+
+				a5::Bitmap& gfx = this->SpecSprite(ii->spec);
+				int gfx_w = gfx.Width();
+				int gfx_h = gfx.Height();
+
+				int draw_x = (ii->x << 5) - (i->y << 5) - ((int(gfx_w) >> 1) - 32) - xoff;
+				int draw_y = (ii->x << 4) + (i->y << 4) - yoff;
+
+				if (in_region(draw_x, draw_y, gfx_w, gfx_h))
+				{
+					this->target.BlitTinted(gfx, tint, draw_x, draw_y);
+					this->stats.Count(Render_Stats::Blits);
+				}
+			}
+		}
+	}
+
+	if (this->show_layers[9] || highlight_spec)
+	{
+		Render_Stats::Scoped_Timer timer(this->stats, Render_Stats::Overlays);
+
+		if (entity_overlays_dirty)
+			this->RebuildEntityOverlays();
+
+		a5::Color tint = a5::RGBA(255, 255, 255, 128);
+
+		for (const Entity_Overlay& overlay : entity_overlays)
+		{
+			if (!vis.Contains(overlay.x, overlay.y))
+				continue;
+
+			a5::Bitmap& gfx = *overlay.gfx;
+			int gfx_w = gfx.Width();
+			int gfx_h = gfx.Height();
+			int draw_x = (overlay.x << 5) - (overlay.y << 5) - ((gfx_w >> 1) - 32) - this->xoff;
+			int draw_y = overlay.yoff + (overlay.x << 4) + (overlay.y << 4) - (gfx_h - 32) - this->yoff;
+
+			if (in_region(draw_x, draw_y, gfx_w, gfx_h))
+			{
+				this->target.BlitTinted(gfx, tint, draw_x, draw_y);
+				this->stats.Count(Render_Stats::Blits);
+			}
+		}
+	}
+}
+
+void Map_Renderer::RebuildTarget(int w, int h)
+{
+	auto tmp = al_get_new_bitmap_flags();
+	al_set_new_bitmap_flags(tmp | ALLEGRO_MIN_LINEAR | ALLEGRO_MAG_LINEAR | ALLEGRO_MIPMAP);
+	target = a5::Bitmap(w, h);
+	back_target = a5::Bitmap(w, h);
+	al_set_new_bitmap_flags(tmp);
+
+	this->max_cached_chunks = MaxCachedChunks(w, h);
+
+	this->Invalidate();
+}
+
+void Map_Renderer::DrawMinimap(a5::Bitmap& dest)
+{
+	if (map->width <= 0 || map->height <= 0)
+		return;
+
+	if (tile_grid_dirty)
+	{
+		this->RebuildTileGrid();
+		this->ResetChunks();
+	}
+
+	if (this->minimap.NeedsRebuild(map->fill_tile))
+		this->minimap.Rebuild(tile_grid, map->width + 1, map->height + 1, map->fill_tile);
+
+	this->minimap.Draw(dest, xoff, yoff, this->ViewWidth(), this->ViewHeight());
+}
+
+void Map_Renderer::SetZoom(float zoom, int display_w, int display_h)
+{
+	this->zoom = zoom;
+
+	if (this->LodActive())
+		this->RebuildTarget(display_w, display_h);
+	else
+		this->RebuildTarget(display_w / zoom, display_h / zoom);
 }
@@ -5,23 +5,343 @@
 
 #include "EO_Map.hpp"
 #include "GFX_Loader.hpp"
+#include "Minimap.hpp"
+#include "Render_Stats.hpp"
+#include "Thread_Pool.hpp"
 
 class Map_Renderer
 {
 	public:
-		a5::Display &real_target;
+		// Range of tile diagonals (x + y) and columns (x - y) which can put
+		// pixels inside of a region of the target
+		struct Visible_Tiles
+		{
+			int diag_min, diag_max;
+			int col_min, col_max;
+
+			bool Contains(int x, int y) const
+			{
+				int diag = x + y;
+				int col = x - y;
+
+				return diag >= diag_min && diag <= diag_max
+				    && col >= col_min && col <= col_max;
+			}
+		};
+
+	protected:
+		// Flattened copy of map->gfxrows, 9 layers per tile
+		std::vector<short> tile_grid;
+		bool tile_grid_dirty = true;
+
+		void RebuildTileGrid();
+
+		short GridTile(int x, int y, int layer) const
+		{
+			return tile_grid[(y * (map->width + 1) + x) * 9 + layer];
+		}
+
+		// The ground layer is pre-rendered in blocks of chunk_tiles x
+		// chunk_tiles tiles, with animated tiles kept in a separate bitmap
+		// so that animation ticks don't need the whole block re-drawn
+		static constexpr int chunk_tiles = 16;
+		static constexpr int chunk_width = (chunk_tiles * 2 - 1) * 32 + 64;
+		static constexpr int chunk_height = (chunk_tiles * 2 - 2) * 16 + 32;
+
+		// Chunks not drawn this frame are kept for about two screens'
+		// worth of scrolling back, and in no more than this much memory.
+		// The limit is set from the view's size by RebuildTarget.
+		static constexpr std::size_t max_chunk_cache_bytes = 128 << 20;
+
+		int max_cached_chunks = 0;
+
+		static int MaxCachedChunks(int view_w, int view_h);
+
+		struct Chunk
+		{
+			struct Animated_Tile
+			{
+				unsigned char x, y;
+				short tile;
+			};
+
+			std::unique_ptr<a5::Bitmap> ground;
+			std::unique_ptr<a5::Bitmap> animated;
+			std::vector<Animated_Tile> animated_tiles;
+			int animated_frame = -1;
+			int last_used = 0;
+			bool dirty = true;
+		};
+
+		std::vector<Chunk> chunks;
+		int chunks_w = 0, chunks_h = 0;
+		int chunks_fill_tile = -1;
+		bool chunks_show_ground = true;
+		// Advanced once for each Render, for the chunks' last_used
+		int frame_counter = 0;
+
+		void ResetChunks();
+		void RenderChunk(int cx, int cy, Chunk& chunk);
+		void RenderChunkAnimation(int cx, int cy, Chunk& chunk);
+		void EvictChunks();
+
+		void DrawGroundTile(a5::Bitmap& dest, short tile, int draw_x, int draw_y);
+
+		// Sprites already resolved through gfxloader, indexed by file then
+		// gfx id. Entries for animated files hold the frame for sprite_anim_state.
+		std::vector<a5::Bitmap*> sprites[26];
+		int sprite_anim_state = -1;
+
+		a5::Bitmap& ResolveSprite(int file, int id);
+
+		a5::Bitmap& Sprite(int file, int id)
+		{
+			std::vector<a5::Bitmap*>& file_sprites = sprites[file];
+
+			if (std::size_t(id) < file_sprites.size() && file_sprites[id])
+				return *file_sprites[id];
+
+			return ResolveSprite(file, id);
+		}
+
+		void ClearSprites()
+		{
+			for (std::vector<a5::Bitmap*>& file_sprites : sprites)
+				file_sprites.clear();
+		}
+
+		// Spec overlay sprites indexed by Tile_Spec, with the generic
+		// sprite in the last slot for unknown specs
+		static constexpr int num_spec_sprites = int(EO_Map::Tile_Spec::Spikes3) + 1;
+		a5::Bitmap* spec_sprites[num_spec_sprites + 1] = {};
+
+		void LoadSpecSprites();
+
+		// Bubbles drawn over warps, chests, signs and NPCs. yoff holds the
+		// bubble's stacking offset above any object on the same tile.
+		struct Entity_Overlay
+		{
+			unsigned char x, y;
+			int yoff;
+			a5::Bitmap* gfx;
+		};
+
+		std::vector<Entity_Overlay> entity_overlays;
+		bool entity_overlays_dirty = true;
+
+		void RebuildEntityOverlays();
+
+		// Screen areas covered by animated sprites in the last full
+		// Render, merged in to blocks once the frame is finished
+		struct Animated_Rect
+		{
+			int x1, y1, x2, y2;
+
+			bool operator<(const Animated_Rect& other) const
+			{
+				if (x1 != other.x1) return x1 < other.x1;
+				if (y1 != other.y1) return y1 < other.y1;
+				if (x2 != other.x2) return x2 < other.x2;
+				return y2 < other.y2;
+			}
+
+			bool operator==(const Animated_Rect& other) const
+			{
+				return x1 == other.x1 && y1 == other.y1 && x2 == other.x2 && y2 == other.y2;
+			}
+		};
+
+		std::vector<Animated_Rect> animated_rects;
+		std::vector<Animated_Rect> animated_blocks;
+		bool recording_animation = false;
+
+		void RenderRegion(a5::Rectangle region);
+		void RedrawRect(const Animated_Rect& rect);
+		void MergeAnimatedRects();
+
+		// The last frame is kept in target so scrolling only has to draw
+		// the newly uncovered strips. These describe what it was drawn with.
+		a5::Bitmap back_target;
+		bool frame_valid = false;
+		int frame_xoff = 0, frame_yoff = 0;
+		int frame_animation_state = 0;
+		int frame_fill_tile = -1;
+		bool frame_highlight_spec = false;
+		bool frame_show_layers[12] = {};
+
+		void ScrollFrame(int dx, int dy);
+
+		// Sprites to be drawn, in painter's order. x and y are the position
+		// of the sprite's tile on the target, and gfx is null for sprites
+		// that the main thread still has to resolve.
+		struct Draw_Command
+		{
+			a5::Bitmap* gfx;
+			int x, y;
+			short tile;
+			unsigned char layer;
+		};
+
+		struct Draw_List
+		{
+			std::vector<Draw_Command> shadows;
+			std::vector<Draw_Command> objects;
+			std::vector<Draw_Command> roofs;
+		};
+
+		// Bands thinner than this aren't worth handing to another thread
+		static constexpr int min_band_diags = 16;
+
+		Thread_Pool draw_pool;
+		std::vector<Draw_List> draw_bands;
+
+		void BuildDrawList(const Visible_Tiles& vis, a5::Rectangle region, Draw_List& list);
+
+		// Tile grid overlay as a list of lines in map coordinates, one for
+		// each edge between rows and columns of tiles, for a grid_w x
+		// grid_h map
+		std::vector<ALLEGRO_VERTEX> grid_vertices;
+		int grid_w = 0, grid_h = 0;
+
+		void RebuildGrid();
+
+		// A sprite from one pass that survived culling, placed and resolved
+		// so it can be reordered by the atlas page it was packed in to
+		struct Batched_Draw
+		{
+			a5::Bitmap* gfx;
+			ALLEGRO_BITMAP* page;
+			int x, y, w, h;
+			int level;
+			short tile;
+			unsigned char layer;
+		};
+
+		// Size of the grid cells OrderBatch tracks overlaps with
+		static constexpr int batch_cell_size = 32;
+
+		std::vector<Batched_Draw> batch;
+		std::vector<Batched_Draw> batch_sorted;
+		std::vector<int> batch_cells;
+		std::vector<int> batch_levels;
+
+		// Reorders batch so that sprites on the same atlas page are drawn
+		// together, without moving a sprite past any sprite it overlaps
+		void OrderBatch(a5::Rectangle region);
+
+		// Zoomed out views are drawn from tiles of the finished map which
+		// are rendered once at a power of two scale, 2^-level, and kept
+		// until something under them changes
+		static constexpr int lod_tile_size = 256;
+		static constexpr int lod_scratch_size = 512;
+		static constexpr int max_lod_level = 3;
+		static constexpr int max_cached_lod_tiles = 256;
+
+		struct Lod_Key
+		{
+			int level, tx, ty;
+
+			bool operator<(const Lod_Key& other) const
+			{
+				if (level != other.level) return level < other.level;
+				if (ty != other.ty) return ty < other.ty;
+				return tx < other.tx;
+			}
+		};
+
+		struct Lod_Tile
+		{
+			std::unique_ptr<a5::Bitmap> bmp;
+			int last_used = 0;
+			bool dirty = true;
+		};
+
+		std::map<Lod_Key, Lod_Tile> lod_tiles;
+		a5::Bitmap lod_scratch;
+		int lod_frame_counter = 0;
+		// Set while RenderLodTile draws through lod_scratch, so chunks
+		// aren't evicted between its pieces
+		bool rendering_lod_tile = false;
+		int lod_fill_tile = -1;
+		bool lod_highlight_spec = false;
+		bool lod_show_layers[12] = {};
+
+		void RenderLod();
+		void RenderLodTile(const Lod_Key& key, Lod_Tile& tile);
+		void EvictLodTiles();
+
+		// Sprites for tiles up to this many frames of movement past the
+		// edge of the view are prefetched, up to max_prefetch_margin pixels
+		static constexpr float prefetch_frames = 20.0f;
+		static constexpr int max_prefetch_margin = 512;
+
+		// Queues the sprites the view is moving towards in gfxloader, and
+		// uploads any that have been decoded with the load time left
+		void Prefetch();
+
+		// Every sprite the map's tiles use, nearest to the view and then most
+		// used first, loaded as fast as the load time allows after the map
+		// is opened. Sprites before warmup_loaded have all been loaded.
+		struct Warm_Up_Sprite
+		{
+			int file;
+			short id;
+		};
+
+		std::vector<Warm_Up_Sprite> warmup_sprites;
+		std::size_t warmup_loaded = 0;
+		bool warmup_started = false;
+
+		void BuildWarmUp();
+		void WarmUp();
+
+		// Loader totals at the start of the frame being counted
+		int stats_load_hits = 0;
+		int stats_load_misses = 0;
+
+		bool BeginStats();
+		void EndStats();
+
+		a5::Bitmap& SpecSprite(EO_Map::Tile_Spec spec)
+		{
+			int i = std::min(int(spec), num_spec_sprites);
+			return *spec_sprites[i];
+		}
+
+	public:
+		a5::Bitmap &real_target;
 		EO_Map *map = nullptr;
 		GFX_Loader gfxloader;
+		Minimap minimap{gfxloader};
+		Render_Stats stats;
 		int xoff = 0, yoff = 0;
 		int animation_state = 0;
+
+		// Smoothed movement of the view between Renders, in map pixels
+		float velocity_x = 0.0f, velocity_y = 0.0f;
 		bool highlight_spec = false;
 		int width = 0, height = 0;
 		bool show_layers[12] = {};
 
+		// Screen pixels per map pixel. At or below max_lod_zoom the target
+		// is screen sized and drawn from LOD tiles, otherwise it is map
+		// sized and scaled when it's put on the screen.
+		float zoom = 1.0f;
+		static constexpr float max_lod_zoom = 0.5f;
+
+		// True if something wasn't drawn because it's still being rendered
+		bool lod_pending = false;
+
+		// Time a frame may spend rendering missing LOD tiles
+		double lod_render_time = 0.030; // 30ms
+
 		a5::Font& font;
 		a5::Bitmap target;
 
-		Map_Renderer(a5::Display &target_, a5::Font& font_) :
+		// target_ is usually the display, but can be any bitmap of the
+		// size to render at
+		Map_Renderer(a5::Bitmap &target_, a5::Font& font_) :
+			draw_pool(std::max(al_get_cpu_count() - 1, 0)),
 			real_target(target_), font(font_)
 		{
 			for (int i = 0; i < 10; ++i)
@@ -33,16 +353,68 @@ class Map_Renderer
 			show_layers[11] = false; // grid lines
 
 			this->RebuildTarget(target_.Width(), target_.Height());
+			this->LoadSpecSprites();
 		}
 
 		void SetMap(EO_Map &map)
 		{
 			gfxloader.Reset();
+			this->ClearSprites();
 			this->map = &map;
 			this->width = std::max(map.width * 32, map.height * 32);
 			this->height = std::max(map.width * 16, map.height * 16);
+			this->MapChanged();
+			this->BeginWarmUp();
+		}
+
+		// Preloads every sprite the map uses, starting from where the view
+		// is on the next Render
+		void BeginWarmUp()
+		{
+			this->warmup_started = true;
 		}
 
+		bool WarmingUp() const
+		{
+			return warmup_started || warmup_loaded < warmup_sprites.size();
+		}
+
+		// Fraction of the warm-up's sprites loaded so far, from 0 to 1
+		float WarmUpProgress() const
+		{
+			if (warmup_started || warmup_sprites.empty())
+				return warmup_started ? 0.0f : 1.0f;
+
+			return float(warmup_loaded) / warmup_sprites.size();
+		}
+
+		// Must be called after the map is loaded, resized or replaced
+		void MapChanged()
+		{
+			this->tile_grid_dirty = true;
+			this->entity_overlays_dirty = true;
+			this->minimap.MapChanged();
+			this->lod_tiles.clear();
+			this->Invalidate();
+		}
+
+		// Must be called after a spec, warp, chest, sign or NPC is edited
+		void EntitiesChanged()
+		{
+			this->entity_overlays_dirty = true;
+			this->lod_tiles.clear();
+			this->Invalidate();
+		}
+
+		// Forces the next Render to draw the whole frame
+		void Invalidate()
+		{
+			this->frame_valid = false;
+		}
+
+		// Must be called after a graphic tile is placed or removed
+		void TileChanged(int x, int y);
+
 		void Move(int x, int y)
 		{
 			this->xoff = x;
@@ -51,12 +423,46 @@ class Map_Renderer
 
 		void ResetView()
 		{
-			this->Move(0 - (int(this->target.Width()) >> 1), 0);
+			this->Move(0 - (this->ViewWidth() >> 1), 0);
 		}
 
+		bool LodActive() const
+		{
+			return this->zoom <= max_lod_zoom;
+		}
+
+		// True if animation ticks change anything in the last frame
+		bool HasAnimation() const
+		{
+			return !LodActive() && !animated_blocks.empty();
+		}
+
+		// Size of the view in map pixels
+		int ViewWidth() const
+		{
+			return LodActive() ? int(this->target.Width() / this->zoom) : this->target.Width();
+		}
+
+		int ViewHeight() const
+		{
+			return LodActive() ? int(this->target.Height() / this->zoom) : this->target.Height();
+		}
+
+		// Resizes the target for a display_w x display_h window at zoom
+		void SetZoom(float zoom, int display_w, int display_h);
+
+		Visible_Tiles VisibleTiles(a5::Rectangle region);
+
 		void Render();
 
+		// Redraws only the parts of the target covered by animated sprites,
+		// leaving the rest of the last Render in place
+		void RenderAnimation();
+
 		void RebuildTarget(int w, int h);
+
+		// Brings the minimap up to date and draws it over dest
+		void DrawMinimap(a5::Bitmap& dest);
 };
 
 #endif // MAP_RENDERER_INCLUDED
@@ -0,0 +1,174 @@
+#include "Minimap.hpp"
+#include "Render_Layers.hpp"
+
+std::uint32_t Minimap::TileColor(const short* layers)
+{
+	GFX_Loader::Color_Summary ground = gfxloader.Summary(3, layers[0] >= 0 ? layers[0] : fill_tile);
+
+	int r = ground.r;
+	int g = ground.g;
+	int b = ground.b;
+
+	// Shadows darken the ground, everything else is mixed in by how much
+	// of its sprite is opaque
+	if (layers[7] > 0)
+	{
+		int shade = 255 - (shadow_alpha * gfxloader.Summary(file_map[7], layers[7]).coverage) / 255;
+
+		r = (r * shade) / 255;
+		g = (g * shade) / 255;
+		b = (b * shade) / 255;
+	}
+
+	auto mix = [&](int layer)
+	{
+		if (layers[layer] <= 0)
+			return;
+
+		GFX_Loader::Color_Summary gfx = gfxloader.Summary(file_map[layer], layers[layer]);
+		int a = gfx.coverage;
+
+		r = (r * (255 - a) + gfx.r * a) / 255;
+		g = (g * (255 - a) + gfx.g * a) / 255;
+		b = (b * (255 - a) + gfx.b * a) / 255;
+	};
+
+	for (int i : object_layers)
+		mix(i);
+
+	mix(8);
+
+	return 0xFF000000 | (std::uint32_t(r) << 16) | (std::uint32_t(g) << 8) | std::uint32_t(b);
+}
+
+void Minimap::PaintTile(int x, int y, const short* layers)
+{
+	int px = (x - y + map_h - 1) * 2;
+	int py = x + y;
+
+	std::uint32_t color = this->TileColor(layers);
+	std::uint32_t* dest = &pixels[py * image_w + px];
+
+	for (int i = 0; i < 4; ++i)
+		dest[i] = color;
+
+	if (dirty_x1 >= dirty_x2)
+	{
+		dirty_x1 = px;
+		dirty_y1 = py;
+		dirty_x2 = px + 4;
+		dirty_y2 = py + 1;
+	}
+	else
+	{
+		dirty_x1 = std::min(dirty_x1, px);
+		dirty_y1 = std::min(dirty_y1, py);
+		dirty_x2 = std::max(dirty_x2, px + 4);
+		dirty_y2 = std::max(dirty_y2, py + 1);
+	}
+}
+
+void Minimap::Upload()
+{
+	if (dirty_x1 >= dirty_x2)
+		return;
+
+	a5::Rectangle rect(dirty_x1, dirty_y1, dirty_x2, dirty_y2);
+	auto lock = image.Lock(rect, a5::Pixel_Format::ARGB_8888, a5::Bitmap::WriteOnly);
+
+	char* start = reinterpret_cast<char*>(lock.Data());
+	std::size_t row_bytes = (dirty_x2 - dirty_x1) * sizeof(std::uint32_t);
+
+	for (int y = dirty_y1; y < dirty_y2; ++y)
+		std::memcpy(start + lock.Pitch() * (y - dirty_y1), &pixels[y * image_w + dirty_x1], row_bytes);
+
+	dirty_x1 = dirty_x2 = 0;
+}
+
+void Minimap::Rebuild(const std::vector<short>& tile_grid, int w, int h, int fill_tile)
+{
+	this->map_w = w;
+	this->map_h = h;
+	this->fill_tile = fill_tile;
+	this->needs_rebuild = false;
+
+	image_w = (w + h) * 2;
+	image_h = w + h - 1;
+
+	pixels.assign(image_w * image_h, 0);
+	image = a5::Bitmap(image_w, image_h);
+
+	for (int y = 0; y < h; ++y)
+	{
+		for (int x = 0; x < w; ++x)
+			this->PaintTile(x, y, &tile_grid[(y * w + x) * 9]);
+	}
+
+	// Clear the corners outside of the map, too
+	dirty_x1 = 0;
+	dirty_y1 = 0;
+	dirty_x2 = image_w;
+	dirty_y2 = image_h;
+}
+
+void Minimap::TileChanged(int x, int y, const short* layers)
+{
+	if (needs_rebuild || x < 0 || y < 0 || x >= map_w || y >= map_h)
+		return;
+
+	this->PaintTile(x, y, layers);
+}
+
+void Minimap::Draw(a5::Bitmap& dest, int view_x, int view_y, int view_w, int view_h)
+{
+	if (image_w <= 0 || image_h <= 0)
+		return;
+
+	this->Upload();
+
+	const int margin = 8;
+	int max_w = dest.Width() / 4;
+	int max_h = dest.Height() / 3;
+
+	screen_scale = std::min({1.0f, float(max_w) / image_w, float(max_h) / image_h});
+	int draw_w = image_w * screen_scale;
+	int draw_h = image_h * screen_scale;
+	screen_x = dest.Width() - margin - draw_w;
+	screen_y = margin;
+
+	al_draw_filled_rectangle(screen_x - 2, screen_y - 2, screen_x + draw_w + 2, screen_y + draw_h + 2, a5::Color(a5::RGBA(0, 0, 0, 160)));
+	dest.BlitScaled(image, a5::Rectangle(screen_x, screen_y, screen_x + draw_w, screen_y + draw_h));
+
+	// Outline of the view, clipped to the minimap
+	float x1 = screen_x + (view_x + (map_h - 1) * 32) * screen_scale / scale;
+	float y1 = screen_y + view_y * screen_scale / scale;
+	float x2 = x1 + view_w * screen_scale / scale;
+	float y2 = y1 + view_h * screen_scale / scale;
+
+	int clip_x, clip_y, clip_w, clip_h;
+	al_get_clipping_rectangle(&clip_x, &clip_y, &clip_w, &clip_h);
+	al_set_clipping_rectangle(screen_x - 2, screen_y - 2, draw_w + 4, draw_h + 4);
+
+	al_draw_rectangle(x1 + 0.5f, y1 + 0.5f, x2 - 0.5f, y2 - 0.5f, a5::Color(a5::RGB(255, 255, 255)), 1.0f);
+
+	al_set_clipping_rectangle(clip_x, clip_y, clip_w, clip_h);
+}
+
+bool Minimap::Contains(int x, int y) const
+{
+	int draw_w = image_w * screen_scale;
+	int draw_h = image_h * screen_scale;
+
+	return image_w > 0
+	    && x >= screen_x && x < screen_x + draw_w
+	    && y >= screen_y && y < screen_y + draw_h;
+}
+
+void Minimap::ViewAt(int x, int y, int view_w, int view_h, int& view_x, int& view_y) const
+{
+	float px = (x - screen_x) / screen_scale;
+	float py = (y - screen_y) / screen_scale;
+
+	view_x = int(px * scale) - (map_h - 1) * 32 - view_w / 2;
+	view_y = int(py * scale) - view_h / 2;
+}
@@ -0,0 +1,75 @@
+#ifndef MINIMAP_INCLUDED
+#define MINIMAP_INCLUDED
+
+#include "common.hpp"
+
+#include "GFX_Loader.hpp"
+
+// Overview of the whole map drawn from each sprite's average colour, so it
+// never has to draw any sprites. It is the isometric view scaled down by
+// scale, making each tile 4 pixels wide and one row of pixels high.
+class Minimap
+{
+	protected:
+		GFX_Loader& gfxloader;
+
+		int map_w = 0, map_h = 0;
+		int fill_tile = -1;
+		bool needs_rebuild = true;
+
+		// ARGB pixels, copied to image by Upload
+		std::vector<std::uint32_t> pixels;
+		int image_w = 0, image_h = 0;
+		a5::Bitmap image;
+
+		// Area of pixels which has changed since the last Upload
+		int dirty_x1 = 0, dirty_y1 = 0, dirty_x2 = 0, dirty_y2 = 0;
+
+		std::uint32_t TileColor(const short* layers);
+		void PaintTile(int x, int y, const short* layers);
+		void Upload();
+
+		// Scale and position of the minimap from the last Draw
+		float screen_scale = 1.0f;
+		int screen_x = 0, screen_y = 0;
+
+	public:
+		// Map pixels per minimap pixel
+		static constexpr int scale = 16;
+
+		bool visible = true;
+
+		Minimap(GFX_Loader& gfxloader_)
+			: gfxloader(gfxloader_)
+		{ }
+
+		bool NeedsRebuild(int fill_tile_) const
+		{
+			return needs_rebuild || fill_tile_ != fill_tile;
+		}
+
+		// Must be called after the map is loaded, resized or replaced
+		void MapChanged()
+		{
+			this->needs_rebuild = true;
+		}
+
+		// tile_grid holds 9 layers for each of the w x h tiles
+		void Rebuild(const std::vector<short>& tile_grid, int w, int h, int fill_tile);
+
+		// layers points to the 9 layers of tile x, y
+		void TileChanged(int x, int y, const short* layers);
+
+		// Draws in the top-right corner of dest with the part of the map
+		// covered by the view outlined
+		void Draw(a5::Bitmap& dest, int view_x, int view_y, int view_w, int view_h);
+
+		// True if x, y on the last destination is over the minimap
+		bool Contains(int x, int y) const;
+
+		// View offset which centres a view_w x view_h view on the part of
+		// the map under x, y
+		void ViewAt(int x, int y, int view_w, int view_h, int& view_x, int& view_y) const;
+};
+
+#endif // MINIMAP_INCLUDED
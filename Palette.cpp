@@ -205,6 +205,15 @@ int Palette::RightClick(int x, int y)
 
 void Pal_Renderer::Render()
 {
+	this->stats.BeginFrame();
+
+	int load_hits = this->gfxloader.load_hits;
+	int load_misses = this->gfxloader.load_misses;
+	int blits = 0;
+	int culled = 0;
+
+	std::optional<Render_Stats::Scoped_Timer> timer(std::in_place, this->stats, Render_Stats::Palette);
+
 	int target_h = this->target.Height();
 
 	std::deque<std::function<void()>> drawcmd;
@@ -213,7 +222,11 @@ void Pal_Renderer::Render()
 	{
 		int draw_x = i->x;
 		int draw_y = i->y - yoff + 32;
-		if (draw_y + i->h >= 0 && draw_y < target_h)
+		if (draw_y + i->h < 0 || draw_y >= target_h)
+		{
+			++culled;
+		}
+		else
 		{
 			a5::Bitmap& bmp = [&]() -> a5::Bitmap&
 			{
@@ -225,24 +238,27 @@ void Pal_Renderer::Render()
 
 			if (i->id == this->pal->selected_tile)
 			{
-				drawcmd.emplace_back([this, &bmp, draw_x, draw_y]()
+				drawcmd.emplace_back([this, &bmp, &blits, draw_x, draw_y]()
 				{
 					if (this->pal->layer == 7)
 					{
 						this->target.BlitTinted(bmp, a5::RGBA(255, 255, 255, 160), draw_x, draw_y);
+						++blits;
 					}
 					else
 					{
 						this->target.Blit(bmp, draw_x, draw_y);
 						this->target.BlitTinted(bmp, a5::RGBA(160, 160, 160, 255), draw_x, draw_y);
+						blits += 2;
 					}
 				});
 			}
 			else
 			{
-				drawcmd.emplace_back([this, &bmp, draw_x, draw_y]()
+				drawcmd.emplace_back([this, &bmp, &blits, draw_x, draw_y]()
 				{
 					this->target.Blit(bmp, draw_x, draw_y);
+					++blits;
 				});
 			}
 		}
@@ -252,4 +268,13 @@ void Pal_Renderer::Render()
 	for (const auto& cmd : drawcmd)
 		cmd();
 	al_hold_bitmap_drawing(false);
+
+	this->stats.Count(Render_Stats::Blits, blits);
+	this->stats.Count(Render_Stats::CulledSprites, culled);
+	this->stats.Count(Render_Stats::LoaderHits, this->gfxloader.load_hits - load_hits);
+	this->stats.Count(Render_Stats::LoaderMisses, this->gfxloader.load_misses - load_misses);
+	this->stats.Count(Render_Stats::DummyFrames, this->gfxloader.dummy_frames_loaded);
+
+	timer.reset();
+	this->stats.EndFrame();
 }
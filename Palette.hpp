@@ -4,6 +4,7 @@
 #include "common.hpp"
 
 #include "GFX_Loader.hpp"
+#include "Render_Stats.hpp"
 
 extern int shared_yoffs[7];
 const bool floor_tiles[25] = { 0, 0, 0,   1,   0,  1,    0,  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
@@ -57,6 +58,7 @@ class Pal_Renderer
 	public:
 		a5::Display &target;
 		GFX_Loader gfxloader;
+		Render_Stats stats;
 		Palette *pal = nullptr;
 		int yoff = 0;
 		int scrollyoff = 0;
@@ -97,6 +99,12 @@ class Pal_Renderer
 			this->Move(0);
 		}
 
+		// Only gfx003 and gfx006 have animated sprites
+		bool HasAnimation() const
+		{
+			return this->pal && (this->pal->file == 3 || this->pal->file == 6);
+		}
+
 		void Render();
 };
 
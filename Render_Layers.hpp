@@ -0,0 +1,74 @@
+#ifndef RENDER_LAYERS_INCLUDED
+#define RENDER_LAYERS_INCLUDED
+
+#include <algorithm>
+
+// Layout of the 9 graphic layers of a map, shared by every renderer so
+// they all put sprites in the same place
+
+// EGF file each layer's graphics are stored in
+static const int file_map[9] = { 3,  4,  5,  6,  6,  7,  3, 22,  5 };
+
+// Offset of each layer's sprites from the top-left corner of their tile
+static const int xoff_map[9] = { 0, -2, -2,  0, 32,  0,  0,-24, -2 };
+static const int yoff_map[9] = { 0, -2, -2, -1, -1,-64,-32,-12, -2 };
+
+// Order objects on the same tile are painted in
+static const int object_layers[6] = { 6, 1, 3, 4, 2, 5 };
+
+// Opacity of the shadow layer
+static const int shadow_alpha = 50;
+
+// Moves a sprite from its tile's position to where it's drawn. Objects
+// stand on the bottom of their tile, and some layers are centred on it.
+inline void place_sprite(int layer, int gfx_w, int gfx_h, int& draw_x, int& draw_y)
+{
+	if (layer == 1 || layer == 2 || layer == 8)
+		draw_x -= gfx_w / 2 - 32;
+
+	if (layer != 7)
+		draw_y -= gfx_h - 32;
+}
+
+// Wide gfx003 and gfx006 bitmaps hold 4 frames of animation side by side
+inline bool is_animated(int file, int bmp_w)
+{
+	return (file == 3 || file == 6) && bmp_w >= 128;
+}
+
+// Part of an EGF bitmap that is drawn for a frame of animation
+struct Sprite_Frame
+{
+	int x, y, w, h;
+};
+
+inline Sprite_Frame sprite_frame(int file, int bmp_w, int bmp_h, int anim)
+{
+	if (!is_animated(file, bmp_w))
+		anim = 0;
+
+	Sprite_Frame frame = {0, 0, bmp_w, bmp_h};
+
+	if (file == 3)
+	{
+		// Ground tiles are always cut down to a single tile
+		frame = {(bmp_w >= 128) ? anim * 64 : 0, 0, 64, 32};
+	}
+	else if (file == 6 && bmp_w >= 128)
+	{
+		int frame_width = bmp_w / 4;
+		frame = {anim * frame_width, 0, frame_width, bmp_h};
+	}
+
+	// Animations larger than 512x512 can't be loaded without increasing the
+	// anim texture atlas size
+	if (anim > 0)
+	{
+		frame.w = std::min(frame.w, 512);
+		frame.h = std::min(frame.h, 512);
+	}
+
+	return frame;
+}
+
+#endif // RENDER_LAYERS_INCLUDED
@@ -0,0 +1,156 @@
+#include "Render_Stats.hpp"
+
+const char* const Render_Stats::pass_names[NumPasses] = {
+	"ground", "draw_lists", "shadows", "grid", "objects", "roofs", "specs", "overlays", "palette"
+};
+
+const char* const Render_Stats::counter_names[NumCounters] = {
+	"blits", "culled", "loader_hits", "loader_misses", "dummy_frames", "texture_switches"
+};
+
+bool Render_Stats::BeginFrame()
+{
+	if (in_frame)
+		return false;
+
+	current = Frame();
+	frame_start = al_get_time();
+	in_frame = true;
+
+	return true;
+}
+
+void Render_Stats::EndFrame()
+{
+	if (!in_frame)
+		return;
+
+	current.total = al_get_time() - frame_start;
+	in_frame = false;
+
+	history.push_back(current);
+
+	if (int(history.size()) > history_size)
+		history.pop_front();
+
+	if (log_file && ++frames_since_log >= log_interval)
+	{
+		this->WriteLog();
+		frames_since_log = 0;
+	}
+}
+
+Render_Stats::Frame Render_Stats::Percentile(double p) const
+{
+	Frame result;
+
+	if (history.empty())
+		return result;
+
+	std::vector<double> values(history.size());
+	std::size_t n = std::min(std::size_t(p * values.size()), values.size() - 1);
+
+	auto select = [&](auto get) -> double
+	{
+		std::transform(history.begin(), history.end(), values.begin(), get);
+		std::nth_element(values.begin(), values.begin() + n, values.end());
+		return values[n];
+	};
+
+	result.total = select([](const Frame& f) { return f.total; });
+
+	for (int i = 0; i < NumPasses; ++i)
+		result.pass_time[i] = select([i](const Frame& f) { return f.pass_time[i]; });
+
+	for (int i = 0; i < NumCounters; ++i)
+		result.counters[i] = int(select([i](const Frame& f) { return double(f.counters[i]); }));
+
+	return result;
+}
+
+void Render_Stats::DrawHUD(a5::Font& font, int x, int y) const
+{
+	const Frame& last = this->Last();
+	Frame p50 = this->Percentile(0.50);
+	Frame p95 = this->Percentile(0.95);
+
+	const int line_height = 10;
+	int lines = 2 + NumPasses + NumCounters;
+
+	al_draw_filled_rectangle(x - 4, y - 4, x + 300, y + lines * line_height + 2, a5::Color(a5::RGBA(0, 0, 0, 192)));
+
+	a5::Color white = a5::RGB(255, 255, 255);
+	a5::Color grey = a5::RGB(160, 160, 160);
+
+	al_draw_textf(font, grey, x, y, 0, "%-14s %7s %7s %7s", "ms", "last", "p50", "p95");
+	y += line_height;
+
+	al_draw_textf(font, white, x, y, 0, "%-14s %7.2f %7.2f %7.2f", "frame",
+		last.total * 1000.0, p50.total * 1000.0, p95.total * 1000.0);
+	y += line_height;
+
+	for (int i = 0; i < NumPasses; ++i)
+	{
+		al_draw_textf(font, white, x, y, 0, "%-14s %7.2f %7.2f %7.2f", pass_names[i],
+			last.pass_time[i] * 1000.0, p50.pass_time[i] * 1000.0, p95.pass_time[i] * 1000.0);
+		y += line_height;
+	}
+
+	for (int i = 0; i < NumCounters; ++i)
+	{
+		al_draw_textf(font, grey, x, y, 0, "%-14s %7d %7d %7d", counter_names[i],
+			last.counters[i], p50.counters[i], p95.counters[i]);
+		y += line_height;
+	}
+}
+
+bool Render_Stats::StartLog(const char* filename)
+{
+	this->StopLog();
+
+	log_file = std::fopen(filename, "a");
+
+	if (!log_file)
+		return false;
+
+	std::fprintf(log_file, "# time frames stat p50 p95 p99 (ms or count)\n");
+	frames_since_log = 0;
+
+	return true;
+}
+
+void Render_Stats::StopLog()
+{
+	if (!log_file)
+		return;
+
+	std::fclose(log_file);
+	log_file = nullptr;
+}
+
+void Render_Stats::WriteLog()
+{
+	Frame p50 = this->Percentile(0.50);
+	Frame p95 = this->Percentile(0.95);
+	Frame p99 = this->Percentile(0.99);
+
+	double now = al_get_time();
+	int frames = int(history.size());
+
+	std::fprintf(log_file, "%.3f %d frame %.3f %.3f %.3f\n", now, frames,
+		p50.total * 1000.0, p95.total * 1000.0, p99.total * 1000.0);
+
+	for (int i = 0; i < NumPasses; ++i)
+	{
+		std::fprintf(log_file, "%.3f %d %s %.3f %.3f %.3f\n", now, frames, pass_names[i],
+			p50.pass_time[i] * 1000.0, p95.pass_time[i] * 1000.0, p99.pass_time[i] * 1000.0);
+	}
+
+	for (int i = 0; i < NumCounters; ++i)
+	{
+		std::fprintf(log_file, "%.3f %d %s %d %d %d\n", now, frames, counter_names[i],
+			p50.counters[i], p95.counters[i], p99.counters[i]);
+	}
+
+	std::fflush(log_file);
+}
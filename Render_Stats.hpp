@@ -0,0 +1,131 @@
+#ifndef RENDER_STATS_INCLUDED
+#define RENDER_STATS_INCLUDED
+
+#include "common.hpp"
+
+// Timings and counters for each frame a renderer draws, kept for the last
+// history_size frames. Times are for submitting the draws on the CPU, as
+// held drawing leaves the GPU work until after the pass has finished.
+class Render_Stats
+{
+	public:
+		enum Pass
+		{
+			Ground,
+			DrawLists,
+			Shadows,
+			Grid,
+			Objects,
+			Roofs,
+			Specs,
+			Overlays,
+			Palette,
+			NumPasses
+		};
+
+		enum Counter
+		{
+			Blits,
+			CulledSprites,
+			LoaderHits,
+			LoaderMisses,
+			DummyFrames,
+			TextureSwitches,
+			NumCounters
+		};
+
+		static const char* const pass_names[NumPasses];
+		static const char* const counter_names[NumCounters];
+
+		struct Frame
+		{
+			double total = 0.0;
+			double pass_time[NumPasses] = {};
+			int counters[NumCounters] = {};
+		};
+
+		// Adds the time until it goes out of scope to a pass
+		class Scoped_Timer
+		{
+			private:
+				Render_Stats& stats;
+				Pass pass;
+				double start;
+
+			public:
+				Scoped_Timer(Render_Stats& stats_, Pass pass_)
+					: stats(stats_)
+					, pass(pass_)
+					, start(al_get_time())
+				{ }
+
+				Scoped_Timer(const Scoped_Timer&) = delete;
+				Scoped_Timer& operator =(const Scoped_Timer&) = delete;
+
+				~Scoped_Timer()
+				{
+					stats.current.pass_time[pass] += al_get_time() - start;
+				}
+		};
+
+		static constexpr int history_size = 240;
+
+		// Frames between lines written to the log
+		static constexpr int log_interval = 120;
+
+	protected:
+		Frame current;
+		double frame_start = 0.0;
+		bool in_frame = false;
+
+		std::deque<Frame> history;
+
+		FILE* log_file = nullptr;
+		int frames_since_log = 0;
+
+		void WriteLog();
+
+	public:
+		Render_Stats() = default;
+		Render_Stats(const Render_Stats&) = delete;
+		Render_Stats& operator =(const Render_Stats&) = delete;
+
+		~Render_Stats()
+		{
+			this->StopLog();
+		}
+
+		// Returns false, and does nothing, if a frame is already started so
+		// that a renderer can call itself
+		bool BeginFrame();
+		void EndFrame();
+
+		void Count(Counter counter, int n = 1)
+		{
+			current.counters[counter] += n;
+		}
+
+		const Frame& Last() const
+		{
+			static const Frame empty;
+			return history.empty() ? empty : history.back();
+		}
+
+		// p is from 0 to 1, each field is taken separately over the history
+		Frame Percentile(double p) const;
+
+		// Draws a summary on to the current target, top-left at x, y
+		void DrawHUD(a5::Font& font, int x, int y) const;
+
+		// Appends percentiles over the history to filename every
+		// log_interval frames
+		bool StartLog(const char* filename);
+		void StopLog();
+
+		bool Logging() const
+		{
+			return log_file != nullptr;
+		}
+};
+
+#endif // RENDER_STATS_INCLUDED
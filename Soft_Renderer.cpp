@@ -0,0 +1,531 @@
+#include "Soft_Renderer.hpp"
+#include "Render_Layers.hpp"
+#include "cio.hpp"
+#include "dib_reader.hpp"
+#include "png_writer.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+
+static int floor_div(int n, int d)
+{
+	return (n >= 0) ? (n / d) : -((d - 1 - n) / d);
+}
+
+// Rounded x / 255 for 0 <= x <= 65535
+static inline std::uint32_t div255(std::uint32_t x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+// Source over destination, matching the separate
+// ADD/ALPHA/INVERSE_ALPHA, ADD/ONE/ONE blender set up in main()
+static inline std::uint32_t blend_pixel(std::uint32_t src, std::uint32_t dst, std::uint32_t alpha)
+{
+	std::uint32_t sa = div255((src >> 24) * alpha);
+
+	if (sa == 0)
+		return dst;
+
+	std::uint32_t inv = 255 - sa;
+	std::uint32_t r = div255(((src >> 16) & 0xFF) * sa + ((dst >> 16) & 0xFF) * inv);
+	std::uint32_t g = div255(((src >>  8) & 0xFF) * sa + ((dst >>  8) & 0xFF) * inv);
+	std::uint32_t b = div255(((src      ) & 0xFF) * sa + ((dst      ) & 0xFF) * inv);
+	std::uint32_t a = std::min<std::uint32_t>(sa + (dst >> 24), 255);
+
+	return (a << 24) | (r << 16) | (g << 8) | b;
+}
+
+#ifdef __SSE2__
+static inline __m128i div255_epi16(__m128i x)
+{
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+#endif // __SSE2__
+
+static void blend_row(std::uint32_t* dst, const std::uint32_t* src, int n, std::uint32_t alpha)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i tint = _mm_set1_epi32(alpha);
+	const __m128i max = _mm_set1_epi16(255);
+	const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+
+		// Per-pixel alpha, scaled by the tint
+		__m128i sa = div255_epi16(_mm_mullo_epi16(_mm_srli_epi32(s, 24), tint));
+
+		// Sprites are mostly made of fully transparent runs
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, zero)) == 0xFFFF)
+			continue;
+
+		__m128i d = _mm_loadu_si128(reinterpret_cast<__m128i*>(dst + i));
+
+		__m128i sa8 = _mm_or_si128(sa, _mm_slli_epi32(sa, 8));
+		sa8 = _mm_or_si128(sa8, _mm_slli_epi32(sa8, 16));
+
+		__m128i a_lo = _mm_unpacklo_epi8(sa8, zero);
+		__m128i a_hi = _mm_unpackhi_epi8(sa8, zero);
+
+		__m128i lo = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), a_lo),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(max, a_lo))
+		);
+
+		__m128i hi = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), a_hi),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(max, a_hi))
+		);
+
+		__m128i rgb = _mm_packus_epi16(div255_epi16(lo), div255_epi16(hi));
+		__m128i a = _mm_adds_epu8(_mm_and_si128(sa8, alpha_mask), _mm_and_si128(d, alpha_mask));
+
+		__m128i result = _mm_or_si128(_mm_andnot_si128(alpha_mask, rgb), a);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), result);
+	}
+#endif // __SSE2__
+
+	for (; i < n; ++i)
+		dst[i] = blend_pixel(src[i], dst[i], alpha);
+}
+
+void Soft_Bitmap::Clear(std::uint32_t color)
+{
+	std::fill(pixels.begin(), pixels.end(), color);
+}
+
+void Soft_Bitmap::Blit(const Soft_Bitmap& src, int x, int y, int alpha)
+{
+	int x1 = std::max(x, 0);
+	int y1 = std::max(y, 0);
+	int x2 = std::min(x + src.width, this->width);
+	int y2 = std::min(y + src.height, this->height);
+
+	if (x1 >= x2 || y1 >= y2 || alpha <= 0)
+		return;
+
+	for (int row = y1; row < y2; ++row)
+		blend_row(this->Row(row) + x1, src.Row(row - y) + (x1 - x), x2 - x1, alpha);
+}
+
+bool Soft_Bitmap::SaveBMP(const char* filename) const
+{
+	std::FILE* fh = std::fopen(filename, "wb");
+
+	if (!fh)
+		return false;
+
+	std::uint32_t image_size = std::uint32_t(pixels.size()) * 4;
+
+	unsigned char header[54] = {'B', 'M'};
+
+	auto put_u16 = [&](int offset, std::uint16_t value)
+	{
+		header[offset] = value & 0xFF;
+		header[offset + 1] = value >> 8;
+	};
+
+	auto put_u32 = [&](int offset, std::uint32_t value)
+	{
+		put_u16(offset, value & 0xFFFF);
+		put_u16(offset + 2, value >> 16);
+	};
+
+	put_u32(2, 54 + image_size);
+	put_u32(10, 54);
+	put_u32(14, 40);
+	put_u32(18, width);
+	put_u32(22, std::uint32_t(-height)); // top-down
+	put_u16(26, 1);
+	put_u16(28, 32);
+	put_u32(34, image_size);
+
+	bool ok = std::fwrite(header, sizeof header, 1, fh) == 1;
+
+	// Pixels are already in BMP's BGRA byte order on little endian hosts
+	for (int y = 0; ok && y < height; ++y)
+	{
+		const std::uint32_t* row = this->Row(y);
+		unsigned char buf[4];
+
+		for (int x = 0; ok && x < width; ++x)
+		{
+			buf[0] = row[x] & 0xFF;
+			buf[1] = (row[x] >> 8) & 0xFF;
+			buf[2] = (row[x] >> 16) & 0xFF;
+			buf[3] = row[x] >> 24;
+			ok = std::fwrite(buf, sizeof buf, 1, fh) == 1;
+		}
+	}
+
+	return (std::fclose(fh) == 0) && ok;
+}
+
+Soft_Renderer::Soft_Renderer(std::string eo_path)
+	: eo_path(std::move(eo_path))
+{
+	for (int i = 0; i < 9; ++i)
+		show_layers[i] = true;
+}
+
+Soft_Renderer::Module& Soft_Renderer::LoadModule(int file)
+{
+	auto cache_it = module_cache.find(file);
+
+	if (cache_it != module_cache.end())
+		return cache_it->second;
+
+	char suffix[sizeof "/gfx/gfx.egf" + 3];
+	snprintf(suffix, sizeof suffix, "/gfx/gfx%03i.egf", file);
+	std::string filename = eo_path + suffix;
+
+	mapped_file module_file(filename.c_str());
+
+	if (!module_file)
+		EOMAP_ERROR("Failed to open: %s", filename.c_str());
+
+	pe_reader module_reader(std::move(module_file));
+
+	if (!module_reader.read_header())
+		EOMAP_ERROR("Failed to load library: %s", filename.c_str());
+
+	auto&& bmp_table = module_reader.read_bitmap_table();
+
+	int max_width = 0;
+	int max_height = 0;
+
+	for (auto&& entry : bmp_table)
+	{
+		max_width = std::max(max_width, entry.second.width);
+		max_height = std::max(max_height, entry.second.height);
+	}
+
+	auto emplace_result = module_cache.emplace(
+		file,
+		Module{std::move(module_reader), std::move(bmp_table), max_width, max_height}
+	);
+
+	return emplace_result.first->second;
+}
+
+int Soft_Renderer::MaxWidth(int file)
+{
+	return this->LoadModule(file).max_width;
+}
+
+int Soft_Renderer::MaxHeight(int file)
+{
+	return this->LoadModule(file).max_height;
+}
+
+const Soft_Bitmap& Soft_Renderer::Sprite(int file, int id)
+{
+	Module& module = this->LoadModule(file);
+
+	auto info_it = module.bmp_table.find(100 + id);
+
+	if (id <= 0 || info_it == module.bmp_table.end())
+		return empty_sprite;
+
+	auto&& info = info_it->second;
+	int anim = is_animated(file, info.width) ? animation_state : 0;
+
+	auto cache_it = sprite_cache.find(Sprite_Key{file, id, anim});
+
+	if (cache_it != sprite_cache.end())
+		return *cache_it->second;
+
+	const char* data = module.egf_reader.resource(info.start, info.size);
+
+	if (!data)
+	{
+		fprintf(stderr, "Can't read BMP %d/%d\n", file, id);
+		return empty_sprite;
+	}
+
+	dib_reader reader(data, info.size);
+
+	auto check_result = reader.check_format();
+
+	if (check_result)
+	{
+		fprintf(stderr, "Can't load BMP %d/%d: %s\n", file, id, check_result);
+		return empty_sprite;
+	}
+
+	try
+	{
+		reader.start(ALLEGRO_PIXEL_FORMAT_ARGB_8888);
+	}
+	catch (std::runtime_error& e)
+	{
+		fprintf(stderr, "Can't load BMP %d/%d: %s\n", file, id, e.what());
+		return empty_sprite;
+	}
+
+	int bmpw = reader.width();
+	int bmph = std::abs(reader.height());
+
+	Soft_Bitmap decoded(bmpw, bmph);
+
+	for (int i = 0; i < bmph; ++i)
+		reader.read_line(reinterpret_cast<char*>(decoded.Row(i)), i);
+
+	Sprite_Frame frame = sprite_frame(file, bmpw, bmph, anim);
+	frame.w = std::min(frame.w, bmpw - frame.x);
+	frame.h = std::min(frame.h, bmph - frame.y);
+
+	auto sprite = std::make_unique<Soft_Bitmap>(std::max(frame.w, 0), std::max(frame.h, 0));
+
+	for (int i = 0; i < sprite->height; ++i)
+		std::copy_n(decoded.Row(frame.y + i) + frame.x, sprite->width, sprite->Row(i));
+
+	auto emplace_result = sprite_cache.emplace(Sprite_Key{file, id, anim}, std::move(sprite));
+	return *emplace_result.first->second;
+}
+
+void Soft_Renderer::RebuildTileGrid(EO_Map& map)
+{
+	tile_grid.assign(9 * (map.width + 1) * (map.height + 1), -1);
+
+	for (int i = 0; i < 9; ++i)
+	{
+		for (std::vector<EO_Map::GFX_Row>::iterator row = map.gfxrows[i].begin(); row != map.gfxrows[i].end(); ++row)
+		{
+			if (row->y > map.height)
+			{
+				continue;
+			}
+
+			for (std::vector<EO_Map::GFX>::iterator tile = row->tiles.begin(); tile != row->tiles.end(); ++tile)
+			{
+				if (tile->x > map.width)
+				{
+					continue;
+				}
+
+				tile_grid[(row->y * (map.width + 1) + tile->x) * 9 + i] = tile->tile;
+			}
+		}
+	}
+}
+
+const Soft_Bitmap& Soft_Renderer::FindSprite(int file, int id) const
+{
+	auto module_it = module_cache.find(file);
+
+	if (module_it == module_cache.end())
+		return empty_sprite;
+
+	auto info_it = module_it->second.bmp_table.find(100 + id);
+
+	if (info_it == module_it->second.bmp_table.end())
+		return empty_sprite;
+
+	int anim = is_animated(file, info_it->second.width) ? animation_state : 0;
+
+	auto cache_it = sprite_cache.find(Sprite_Key{file, id, anim});
+
+	if (cache_it == sprite_cache.end())
+		return empty_sprite;
+
+	return *cache_it->second;
+}
+
+void Soft_Renderer::Prepare(EO_Map& map)
+{
+	this->RebuildTileGrid(map);
+
+	this->Sprite(3, map.fill_tile);
+
+	for (std::size_t i = 0; i < tile_grid.size(); ++i)
+	{
+		if (tile_grid[i] >= 0)
+			this->Sprite(file_map[i % 9], tile_grid[i]);
+	}
+
+	// How far sprites can reach from their tile, for culling the same
+	// tiles as Map_Renderer::VisibleTiles: objects grow upwards from the
+	// bottom of their tile, while ground tiles and shadows hang down
+	// from the top of theirs
+	max_sprite_height = 0;
+
+	for (int file : {3, 4, 5, 6, 7, 22})
+		max_sprite_height = std::max(max_sprite_height, this->MaxHeight(file));
+
+	max_sprite_above = std::max({64, this->MaxHeight(3), this->MaxHeight(22)});
+
+	prepared_map = &map;
+}
+
+void Soft_Renderer::Draw(Soft_Bitmap& target, int xoff, int yoff) const
+{
+	const EO_Map& map = *prepared_map;
+
+	if (map.width <= 0 || map.height <= 0)
+		return;
+
+	int map_w = map.width;
+	int map_h = map.height;
+
+	auto grid_tile = [&](int x, int y, int layer) -> short
+	{
+		return tile_grid[(y * (map_w + 1) + x) * 9 + layer];
+	};
+
+	// Only diagonals that can reach in to the target are visited
+	int diag_min = std::max(0, floor_div(yoff - max_sprite_above, 16));
+	int diag_max = std::min(map_w + map_h, floor_div(yoff + target.height + max_sprite_height + 128, 16) + 1);
+
+	// Tiles are visited a diagonal at a time, back to front
+	auto for_each_tile = [&](auto fn)
+	{
+		for (int diag = diag_min; diag <= diag_max; ++diag)
+		{
+			int x_end = std::min(map_w, diag);
+
+			for (int x = std::max(0, diag - map_h); x <= x_end; ++x)
+				fn(x, diag - x);
+		}
+	};
+
+	auto draw_layer = [&](int x, int y, int layer, int alpha)
+	{
+		short tile = grid_tile(x, y, layer);
+
+		if (tile < 0)
+			return;
+
+		const Soft_Bitmap& gfx = this->FindSprite(file_map[layer], tile);
+		int draw_x = xoff_map[layer] - xoff + (x * 32) - (y * 32);
+		int draw_y = yoff_map[layer] - yoff + (x * 16) + (y * 16);
+
+		place_sprite(layer, gfx.width, gfx.height, draw_x, draw_y);
+
+		target.Blit(gfx, draw_x, draw_y, alpha);
+	};
+
+	for_each_tile([&](int x, int y)
+	{
+		short tile = this->show_layers[0] ? grid_tile(x, y, 0) : -1;
+
+		if (tile < 0)
+			tile = map.fill_tile;
+
+		int draw_x = (x * 32) - (y * 32) - xoff;
+		int draw_y = (x * 16) + (y * 16) - yoff;
+
+		target.Blit(this->FindSprite(3, tile), draw_x, draw_y);
+	});
+
+	if (this->show_layers[7])
+	{
+		for_each_tile([&](int x, int y)
+		{
+			draw_layer(x, y, 7, shadow_alpha);
+		});
+	}
+
+	for_each_tile([&](int x, int y)
+	{
+		for (int i : object_layers)
+		{
+			if (this->show_layers[i])
+				draw_layer(x, y, i, 255);
+		}
+	});
+
+	if (this->show_layers[8])
+	{
+		for_each_tile([&](int x, int y)
+		{
+			draw_layer(x, y, 8, 255);
+		});
+	}
+}
+
+void Soft_Renderer::Render(EO_Map& map, Soft_Bitmap& target, int xoff, int yoff)
+{
+	this->Prepare(map);
+	this->Draw(target, xoff, yoff);
+}
+
+void Soft_Renderer::MapBounds(EO_Map& map, int& width, int& height, int& xoff, int& yoff)
+{
+	// Leave room for sprites hanging off the top and sides of the map
+	int pad_x = 0;
+	int pad_top = 0;
+
+	for (int file : {4, 5, 6, 7, 22})
+	{
+		pad_x = std::max(pad_x, this->MaxWidth(file) / 2);
+		pad_top = std::max(pad_top, this->MaxHeight(file) + 32);
+	}
+
+	width = std::max((map.width + map.height) * 32 + 64 + pad_x * 2, 1);
+	height = std::max((map.width + map.height) * 16 + 32 + pad_top, 1);
+	xoff = -map.height * 32 - pad_x;
+	yoff = -pad_top;
+}
+
+Soft_Bitmap Soft_Renderer::RenderMap(EO_Map& map)
+{
+	int width, height, xoff, yoff;
+	this->MapBounds(map, width, height, xoff, yoff);
+
+	Soft_Bitmap target(width, height, 0xFF000000);
+	this->Render(map, target, xoff, yoff);
+
+	return target;
+}
+
+bool Soft_Renderer::ExportPNG(EO_Map& map, const char* filename, Thread_Pool& pool, int band_height)
+{
+	int width, height, xoff, yoff;
+	this->MapBounds(map, width, height, xoff, yoff);
+
+	png_writer png;
+
+	if (!png.open(filename, width, height))
+		return false;
+
+	this->Prepare(map);
+
+	// A batch of bands is rendered at once, one per thread, then written
+	// out in order before the next batch starts
+	int batch_size = pool.Threads() + 1;
+	std::vector<Soft_Bitmap> bands(batch_size);
+
+	for (int batch_y = 0; batch_y < height; batch_y += band_height * batch_size)
+	{
+		int batch_bands = std::min(batch_size, (height - batch_y + band_height - 1) / band_height);
+
+		pool.Run(batch_bands, [&](int i)
+		{
+			int band_y = batch_y + i * band_height;
+			int band_h = std::min(band_height, height - band_y);
+
+			if (bands[i].width != width || bands[i].height != band_h)
+				bands[i] = Soft_Bitmap(width, band_h);
+
+			bands[i].Clear(0xFF000000);
+			this->Draw(bands[i], xoff, yoff + band_y);
+		});
+
+		for (int i = 0; i < batch_bands; ++i)
+		{
+			for (int y = 0; y < bands[i].height; ++y)
+				png.write_row(bands[i].Row(y));
+		}
+	}
+
+	return png.close();
+}
@@ -0,0 +1,128 @@
+#ifndef SOFT_RENDERER_INCLUDED
+#define SOFT_RENDERER_INCLUDED
+
+#include "common.hpp"
+
+#include "EO_Map.hpp"
+#include "pe_reader.hpp"
+#include "Thread_Pool.hpp"
+
+// 32-bit ARGB image held in system memory
+struct Soft_Bitmap
+{
+	int width = 0;
+	int height = 0;
+	std::vector<std::uint32_t> pixels;
+
+	Soft_Bitmap() = default;
+
+	Soft_Bitmap(int width_, int height_, std::uint32_t color = 0)
+		: width(width_)
+		, height(height_)
+		, pixels(std::size_t(width_) * height_, color)
+	{ }
+
+	std::uint32_t* Row(int y)
+	{
+		return &pixels[std::size_t(y) * width];
+	}
+
+	const std::uint32_t* Row(int y) const
+	{
+		return &pixels[std::size_t(y) * width];
+	}
+
+	void Clear(std::uint32_t color);
+
+	// Blends src on to this bitmap the same way the map renderer's blender
+	// does, with src's alpha scaled by alpha / 255
+	void Blit(const Soft_Bitmap& src, int x, int y, int alpha = 255);
+
+	// Writes a 32-bit BMP file
+	bool SaveBMP(const char* filename) const;
+};
+
+// Renders the graphic layers of a map entirely on the CPU, decoding
+// sprites straight out of the EGF files, so it can run without a display
+class Soft_Renderer
+{
+	protected:
+		struct Module
+		{
+			pe_reader egf_reader;
+			std::map<int, pe_reader::BitmapInfo> bmp_table;
+			int max_width = 0;
+			int max_height = 0;
+		};
+
+		struct Sprite_Key
+		{
+			int file;
+			int id;
+			int frame;
+
+			bool operator<(const Sprite_Key& other) const noexcept
+			{
+				return (file == other.file)
+					? (id == other.id)
+						? (frame < other.frame)
+						: (id < other.id)
+					: (file < other.file);
+			}
+		};
+
+		std::string eo_path;
+
+		std::map<int, Module> module_cache;
+		std::map<Sprite_Key, std::unique_ptr<Soft_Bitmap>> sprite_cache;
+		Soft_Bitmap empty_sprite;
+
+		std::vector<short> tile_grid;
+		const EO_Map* prepared_map = nullptr;
+		int max_sprite_height = 0;
+		int max_sprite_above = 0;
+
+		Module& LoadModule(int file);
+		const Soft_Bitmap& Sprite(int file, int id);
+
+		// Only looks in the cache, so is safe to call from several threads
+		const Soft_Bitmap& FindSprite(int file, int id) const;
+
+		void RebuildTileGrid(EO_Map& map);
+
+	public:
+		int animation_state = 0;
+		bool show_layers[9];
+
+		// eo_path is the directory holding the gfx folder
+		Soft_Renderer(std::string eo_path);
+
+		// Largest bitmap dimensions found in a file
+		int MaxWidth(int file);
+		int MaxHeight(int file);
+
+		// Builds the tile grid and decodes every sprite the map uses for
+		// the current animation_state
+		void Prepare(EO_Map& map);
+
+		// Renders the part of the prepared map whose top-left corner is at
+		// xoff, yoff. Doesn't modify the renderer, so several threads can
+		// draw different parts of the map at once.
+		void Draw(Soft_Bitmap& target, int xoff, int yoff) const;
+
+		// Prepares the map and then draws it
+		void Render(EO_Map& map, Soft_Bitmap& target, int xoff, int yoff);
+
+		// Size of an image which holds the whole map, and the view offset
+		// which places the map in it
+		void MapBounds(EO_Map& map, int& width, int& height, int& xoff, int& yoff);
+
+		// Renders the whole map in to a bitmap just big enough to hold it
+		Soft_Bitmap RenderMap(EO_Map& map);
+
+		// Renders the whole map to a PNG file in horizontal bands spread
+		// over the pool, so only a few bands are ever held in memory
+		bool ExportPNG(EO_Map& map, const char* filename, Thread_Pool& pool, int band_height = 128);
+};
+
+#endif // SOFT_RENDERER_INCLUDED
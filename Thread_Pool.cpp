@@ -0,0 +1,86 @@
+#include "Thread_Pool.hpp"
+
+void Thread_Pool::Worker::operator()()
+{
+	pool->mutex.Lock();
+
+	while (true)
+	{
+		while (!pool->stopping && pool->next_job >= pool->job_count)
+			pool->work_ready.Wait(pool->mutex);
+
+		if (pool->stopping)
+			break;
+
+		pool->RunJobs();
+	}
+
+	pool->mutex.Unlock();
+}
+
+Thread_Pool::Thread_Pool(int num_threads)
+{
+	for (int i = 0; i < num_threads; ++i)
+	{
+		workers.push_back(std::make_unique<Worker>(this));
+		threads.push_back(std::make_unique<a5::Thread>(*workers.back()));
+		threads.back()->Start();
+	}
+}
+
+Thread_Pool::~Thread_Pool()
+{
+	mutex.Lock();
+	stopping = true;
+	work_ready.Broadcast();
+	mutex.Unlock();
+
+	for (auto&& thread : threads)
+		thread->Join();
+}
+
+void Thread_Pool::RunJobs()
+{
+	while (next_job < job_count)
+	{
+		int i = next_job++;
+
+		mutex.Unlock();
+		job(i);
+		mutex.Lock();
+
+		if (++jobs_finished == job_count)
+			work_done.Broadcast();
+	}
+}
+
+void Thread_Pool::Run(int count, std::function<void(int)> job)
+{
+	if (threads.empty() || count <= 1)
+	{
+		for (int i = 0; i < count; ++i)
+			job(i);
+
+		return;
+	}
+
+	mutex.Lock();
+
+	this->job = std::move(job);
+	job_count = count;
+	next_job = 0;
+	jobs_finished = 0;
+
+	work_ready.Broadcast();
+
+	this->RunJobs();
+
+	while (jobs_finished < job_count)
+		work_done.Wait(mutex);
+
+	job_count = 0;
+	next_job = 0;
+	this->job = nullptr;
+
+	mutex.Unlock();
+}
@@ -0,0 +1,49 @@
+#ifndef THREAD_POOL_INCLUDED
+#define THREAD_POOL_INCLUDED
+
+#include "common.hpp"
+
+// Fixed set of worker threads for splitting a frame's work in to jobs
+class Thread_Pool
+{
+	protected:
+		struct Worker : public a5::Thread_Proc
+		{
+			Thread_Pool* pool;
+
+			Worker(Thread_Pool* pool_) : pool(pool_) { }
+
+			void operator()();
+		};
+
+		std::vector<std::unique_ptr<Worker>> workers;
+		std::vector<std::unique_ptr<a5::Thread>> threads;
+
+		a5::Mutex mutex;
+		a5::Condition work_ready;
+		a5::Condition work_done;
+
+		std::function<void(int)> job;
+		int job_count = 0;
+		int next_job = 0;
+		int jobs_finished = 0;
+		bool stopping = false;
+
+		// Runs queued jobs until there are none left. mutex must be held.
+		void RunJobs();
+
+	public:
+		Thread_Pool(int num_threads);
+		~Thread_Pool();
+
+		int Threads() const
+		{
+			return int(threads.size());
+		}
+
+		// Calls job(0) to job(count - 1) spread across the pool and the
+		// calling thread, and returns once every call has finished
+		void Run(int count, std::function<void(int)> job);
+};
+
+#endif // THREAD_POOL_INCLUDED
@@ -157,6 +157,18 @@ class Condition
 			al_wait_cond_until(*this, mutex, &timeout_);
 		}
 
+		/// Wakes up one thread waiting on the condition
+		void Signal()
+		{
+			al_signal_cond(*this);
+		}
+
+		/// Wakes up every thread waiting on the condition
+		void Broadcast()
+		{
+			al_broadcast_cond(*this);
+		}
+
 		/// Releases the held C structure so it is no longer automatically freed
 		ALLEGRO_COND *Release()
 		{
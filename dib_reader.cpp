@@ -12,7 +12,6 @@
 
 #define NUM_CONVERT_TABLES 8
 
-static bool convert_table_init = false;
 static int convert_table[(1 << (NUM_CONVERT_TABLES + 1)) - 1];
 
 static int* get_convert_table(int bit)
@@ -60,6 +59,14 @@ static void generate_scale_table(int* table, int entries)
 		table[i] = (i * 510 + tblsize) / tblsize / 2;
 }
 
+static bool generate_convert_tables()
+{
+	for (int i = 0; i <= NUM_CONVERT_TABLES; ++i)
+		generate_scale_table(get_convert_table(i), 1 << i);
+
+	return true;
+}
+
 static read_fn_t read_fn_for_bpp(int bpp) noexcept
 {
 	switch (bpp)
@@ -167,26 +174,22 @@ void dib_reader::prepare_bitfields() noexcept
 		}
 	}
 
-	if (!convert_table_init)
-		convert_table[0] = 0;
+	// Readers run on several threads, and a local static is only ever
+	// initialized by one of them
+	static const bool convert_table_init = generate_convert_tables();
+	(void)convert_table_init;
 
 	for (int i = 0; i <= NUM_CONVERT_TABLES; ++i)
 	{
 		std::uint32_t mask = ~(0xFFFFFFFFU << i) & 0xFFFFFFFFU;
 
 		int* table = get_convert_table(i);
-		int entries = (1 << i);
-
-		if (!convert_table_init)
-			generate_scale_table(table, entries);
 
 		if (rm == mask) rtable = table;
 		if (gm == mask) gtable = table;
 		if (bm == mask) btable = table;
 		// (am == mask) atable = table;
 	}
-
-	convert_table_init = true;
 }
 
 void dib_reader::prepare_palette() noexcept
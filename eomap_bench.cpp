@@ -0,0 +1,367 @@
+#include "common.hpp"
+
+#include <physfs.h>
+
+#include <cmath>
+
+#include "EO_Map.hpp"
+#include "Map_Renderer.hpp"
+#include "Render_Layers.hpp"
+
+// Renders maps in to memory bitmaps along a fixed script of viewports, zoom
+// levels and animation frames, and prints the frame times as JSON. Nothing
+// is shown on screen, so it runs on headless machines, and the same
+// arguments always draw exactly the same frames.
+
+std::string g_eo_install_path;
+
+extern "C" char builtin_data[];
+extern "C" std::size_t builtin_data_size;
+
+struct Bench_Map
+{
+	std::string name;
+	EO_Map map;
+};
+
+struct Bench_Result
+{
+	std::string map;
+	int width, height;
+	float zoom;
+	std::vector<double> times;
+	std::vector<int> blits;
+	std::vector<int> switches;
+};
+
+static void usage(const char* argv0)
+{
+	std::fprintf(stderr,
+		"Usage: %s <eo-directory> [options] [map.emf ...]\n"
+		"  --frames N       measured frames per map and zoom (default 300)\n"
+		"  --warmup N       unmeasured frames before each run (default 30)\n"
+		"  --size WxH       size of the view in pixels (default 1280x720)\n"
+		"  --no-synthetic   only render the maps given\n"
+		"  --output FILE    write the JSON to FILE instead of stdout\n"
+		"  --gfx-cache DIR  keep decoded sprites in DIR between runs\n",
+		argv0);
+}
+
+// Fills a map with tiles picked by a fixed random sequence. density is the
+// percentage of tiles with an object on them; the other layers are set in
+// proportion to it.
+static void make_synthetic(EO_Map& map, GFX_Loader& loader, int w, int h, int density, unsigned seed)
+{
+	auto next = [&seed]()
+	{
+		seed = seed * 1103515245U + 12345U;
+		return int((seed >> 16) & 0x7FFF);
+	};
+
+	map.width = w - 1;
+	map.height = h - 1;
+	map.fill_tile = 1;
+	map.loaded = true;
+
+	static const int layer_density[9] = {100, 100, 50, 50, 50, 25, 25, 50, 25};
+
+	for (int layer = 0; layer < 9; ++layer)
+	{
+		int count = loader.CountBitmaps(file_map[layer]);
+		int chance = (layer == 0) ? 100 : (density * layer_density[layer]) / 100;
+
+		if (count == 0)
+			continue;
+
+		for (int y = 0; y < h; ++y)
+		{
+			EO_Map::GFX_Row row;
+			row.y = y;
+
+			for (int x = 0; x < w; ++x)
+			{
+				if (next() % 100 < chance)
+					row.tiles.push_back({static_cast<unsigned char>(x), static_cast<short>(1 + next() % count)});
+			}
+
+			if (!row.tiles.empty())
+				map.gfxrows[layer].push_back(std::move(row));
+		}
+	}
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+	if (values.empty())
+		return 0.0;
+
+	std::size_t n = std::min(std::size_t(p * values.size()), values.size() - 1);
+	std::nth_element(values.begin(), values.begin() + n, values.end());
+	return values[n];
+}
+
+static std::string json_string(const std::string& s)
+{
+	std::string result = "\"";
+
+	for (char c : s)
+	{
+		if (c == '"' || c == '\\')
+			result += '\\';
+
+		result += c;
+	}
+
+	return result + "\"";
+}
+
+static Bench_Result run(Map_Renderer& renderer, Bench_Map& bench_map, float zoom, int view_w, int view_h, int warmup, int frames)
+{
+	EO_Map& map = bench_map.map;
+
+	Bench_Result result{bench_map.name, map.width + 1, map.height + 1, zoom, {}, {}, {}};
+
+	renderer.SetMap(map);
+	renderer.SetZoom(zoom, view_w, view_h);
+
+	// The view circles the middle of the map, moving about 16 screen
+	// pixels a frame, with the animation stepping every 30 frames as it
+	// would at 60fps
+	double centre_x = (map.width - map.height) * 16.0;
+	double centre_y = (map.width + map.height) * 8.0;
+	double radius = std::max(std::min(map.width, map.height) * 8.0, 64.0);
+	double step = 16.0 / (radius * zoom);
+
+	for (int frame = -warmup; frame < frames; ++frame)
+	{
+		double t = step * (frame + warmup);
+
+		renderer.Move(
+			int(centre_x + radius * std::cos(t)) - renderer.ViewWidth() / 2,
+			int(centre_y + radius * std::sin(t)) - renderer.ViewHeight() / 2
+		);
+
+		renderer.animation_state = ((frame + warmup) / 30) & 0x3;
+
+		// Everything is loaded straight away so every run draws the same
+		renderer.gfxloader.SetLoadTime(1.0e9);
+
+		renderer.target.Target();
+
+		double start = al_get_time();
+
+		al_hold_bitmap_drawing(true);
+		renderer.Render();
+		al_hold_bitmap_drawing(false);
+
+		double end = al_get_time();
+
+		if (frame >= 0)
+		{
+			result.times.push_back(end - start);
+			result.blits.push_back(renderer.stats.Last().counters[Render_Stats::Blits]);
+			result.switches.push_back(renderer.stats.Last().counters[Render_Stats::TextureSwitches]);
+		}
+	}
+
+	return result;
+}
+
+static void write_json(FILE* out, const std::vector<Bench_Result>& results, int view_w, int view_h)
+{
+	std::fprintf(out, "{\n");
+	std::fprintf(out, "  \"view_width\": %d,\n", view_w);
+	std::fprintf(out, "  \"view_height\": %d,\n", view_h);
+	std::fprintf(out, "  \"threads\": %d,\n", std::max(al_get_cpu_count() - 1, 0) + 1);
+	std::fprintf(out, "  \"runs\": [");
+
+	for (std::size_t i = 0; i < results.size(); ++i)
+	{
+		const Bench_Result& r = results[i];
+
+		double total_time = 0.0;
+		long long total_blits = 0;
+		long long total_switches = 0;
+
+		for (double t : r.times)
+			total_time += t;
+
+		for (int b : r.blits)
+			total_blits += b;
+
+		for (int n : r.switches)
+			total_switches += n;
+
+		int frames = int(r.times.size());
+		double mean_ms = frames ? (total_time / frames) * 1000.0 : 0.0;
+		double mean_blits = frames ? double(total_blits) / frames : 0.0;
+		double mean_switches = frames ? double(total_switches) / frames : 0.0;
+		int max_blits = r.blits.empty() ? 0 : *std::max_element(r.blits.begin(), r.blits.end());
+
+		std::fprintf(out, "%s\n    {\n", i ? "," : "");
+		std::fprintf(out, "      \"map\": %s,\n", json_string(r.map).c_str());
+		std::fprintf(out, "      \"map_width\": %d,\n", r.width);
+		std::fprintf(out, "      \"map_height\": %d,\n", r.height);
+		std::fprintf(out, "      \"zoom\": %.2f,\n", r.zoom);
+		std::fprintf(out, "      \"frames\": %d,\n", frames);
+		std::fprintf(out, "      \"mean_ms\": %.3f,\n", mean_ms);
+		std::fprintf(out, "      \"p50_ms\": %.3f,\n", percentile(r.times, 0.50) * 1000.0);
+		std::fprintf(out, "      \"p95_ms\": %.3f,\n", percentile(r.times, 0.95) * 1000.0);
+		std::fprintf(out, "      \"max_ms\": %.3f,\n", percentile(r.times, 1.00) * 1000.0);
+		std::fprintf(out, "      \"mean_blits\": %.1f,\n", mean_blits);
+		std::fprintf(out, "      \"max_blits\": %d,\n", max_blits);
+		std::fprintf(out, "      \"mean_texture_switches\": %.1f\n", mean_switches);
+		std::fprintf(out, "    }");
+	}
+
+	std::fprintf(out, "\n  ]\n}\n");
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	int frames = 300;
+	int warmup = 30;
+	int view_w = 1280;
+	int view_h = 720;
+	bool synthetic = true;
+	const char* output = nullptr;
+	const char* gfx_cache = nullptr;
+	std::vector<std::string> map_files;
+
+	for (int i = 2; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		bool has_value = (i + 1 < argc);
+
+		if (arg == "--frames" && has_value)
+			frames = std::max(std::atoi(argv[++i]), 1);
+		else if (arg == "--warmup" && has_value)
+			warmup = std::max(std::atoi(argv[++i]), 0);
+		else if (arg == "--size" && has_value)
+		{
+			if (std::sscanf(argv[++i], "%dx%d", &view_w, &view_h) != 2 || view_w <= 0 || view_h <= 0)
+			{
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		else if (arg == "--no-synthetic")
+			synthetic = false;
+		else if (arg == "--output" && has_value)
+			output = argv[++i];
+		else if (arg == "--gfx-cache" && has_value)
+			gfx_cache = argv[++i];
+		else if (arg.size() > 0 && arg[0] != '-')
+			map_files.push_back(arg);
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	g_eo_install_path = argv[1];
+
+	try
+	{
+		a5::_init();
+
+		if (!PHYSFS_init(argv[0])
+		 || !PHYSFS_mountMemory(builtin_data, builtin_data_size, nullptr, "builtin.zip", nullptr, 0))
+		{
+			std::fprintf(stderr, "Failed to mount built-in data\n");
+			return 1;
+		}
+
+		// No display is ever created, so everything is drawn in software
+		al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+
+		al_set_separate_blender(
+			ALLEGRO_ADD, ALLEGRO_ALPHA, ALLEGRO_INVERSE_ALPHA,
+			ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ONE
+		);
+
+		a5::disable_auto_target = true;
+
+		a5::Font font(al_create_builtin_font());
+		a5::Bitmap screen(view_w, view_h);
+		Map_Renderer renderer(screen, font);
+
+		// LOD tiles are all rendered on the frame they're first needed,
+		// and sprites decoded on the frame they're first drawn
+		renderer.lod_render_time = 1.0e9;
+		renderer.gfxloader.SetDecodeThreads(0);
+
+		if (gfx_cache)
+			renderer.gfxloader.SetCacheDirectory(gfx_cache);
+
+		std::vector<std::unique_ptr<Bench_Map>> maps;
+
+		for (const std::string& filename : map_files)
+		{
+			auto bench_map = std::make_unique<Bench_Map>();
+			bench_map->name = filename;
+			bench_map->map.Load(filename);
+			maps.push_back(std::move(bench_map));
+		}
+
+		if (synthetic)
+		{
+			struct { const char* name; int size; int density; } synthetic_maps[] = {
+				{"synthetic-sparse-64",  64, 10},
+				{"synthetic-dense-128", 128, 40},
+				{"synthetic-full-255",  255, 80}
+			};
+
+			for (auto&& s : synthetic_maps)
+			{
+				auto bench_map = std::make_unique<Bench_Map>();
+				bench_map->name = s.name;
+				make_synthetic(bench_map->map, renderer.gfxloader, s.size, s.size, s.density, 12345);
+				maps.push_back(std::move(bench_map));
+			}
+		}
+
+		std::vector<Bench_Result> results;
+
+		for (auto&& bench_map : maps)
+		{
+			for (float zoom : {1.0f, 0.5f, 0.25f, 0.1f})
+			{
+				std::fprintf(stderr, "%s @ %.2f\n", bench_map->name.c_str(), zoom);
+				results.push_back(run(renderer, *bench_map, zoom, view_w, view_h, warmup, frames));
+			}
+		}
+
+		FILE* out = output ? std::fopen(output, "w") : stdout;
+
+		if (!out)
+		{
+			std::fprintf(stderr, "Failed to write: %s\n", output);
+			return 1;
+		}
+
+		write_json(out, results, view_w, view_h);
+
+		if (out != stdout)
+			std::fclose(out);
+	}
+	catch (EOMap_Exception& e)
+	{
+		std::fprintf(stderr, "eomap exception: %s\n", e.message());
+		return 1;
+	}
+	catch (std::exception& e)
+	{
+		std::fprintf(stderr, "std exception: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,72 @@
+#include "common.hpp"
+
+#include "EO_Map.hpp"
+#include "Soft_Renderer.hpp"
+
+// Renders a map to a BMP or PNG file without needing a display, for map
+// previews, published world maps and visual regression tests on headless
+// machines
+
+static void usage(const char* argv0)
+{
+	std::fprintf(stderr, "Usage: %s <eo-directory> <map.emf> <output.bmp|output.png> [animation-frame]\n", argv0);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 4 || argc > 5)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	// Only needed for threads, no display is created
+	if (!al_init())
+	{
+		std::fprintf(stderr, "Failed to initialize allegro\n");
+		return 1;
+	}
+
+	try
+	{
+		EO_Map map;
+		map.Load(argv[2]);
+
+		Soft_Renderer renderer(argv[1]);
+
+		if (argc == 5)
+			renderer.animation_state = std::atoi(argv[4]) & 0x3;
+
+		std::string output = argv[3];
+		bool ok;
+
+		// PNGs are streamed out in bands, which works for any size of map
+		if (output.size() >= 4 && output.compare(output.size() - 4, 4, ".png") == 0)
+		{
+			Thread_Pool pool(std::max(al_get_cpu_count() - 1, 0));
+			ok = renderer.ExportPNG(map, output.c_str(), pool);
+		}
+		else
+		{
+			ok = renderer.RenderMap(map).SaveBMP(output.c_str());
+		}
+
+		if (!ok)
+		{
+			std::fprintf(stderr, "Failed to write: %s\n", output.c_str());
+			return 1;
+		}
+	}
+	catch (EOMap_Exception& e)
+	{
+		std::fprintf(stderr, "eomap exception: %s\n", e.message());
+		return 1;
+	}
+	catch (std::exception& e)
+	{
+		std::fprintf(stderr, "std exception: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -2,7 +2,9 @@
 #include "common.hpp"
 #include <physfs.h>
 
+#include "cio.hpp"
 #include "EO_Map.hpp"
+#include "Frame_Scheduler.hpp"
 #include "Map_Renderer.hpp"
 #include "Palette.hpp"
 #ifdef WIN32
@@ -19,7 +21,6 @@
 	q.Register(pal_display); \
 	q.Register(keyboard); \
 	q.Register(mouse); \
-	q.Register(timer); \
 	q.Register(anim_timer); \
 	al_register_event_source(q, al_menu_source); \
 }
@@ -30,7 +31,6 @@
 	q.Unregister(pal_display); \
 	q.Unregister(keyboard); \
 	q.Unregister(mouse); \
-	q.Unregister(timer); \
 	q.Unregister(anim_timer); \
 	al_unregister_event_source(q, al_menu_source); \
 }
@@ -311,7 +311,6 @@ int main(int argc, char** argv)
 	a5::Keyboard keyboard;
 	a5::Mouse mouse;
 
-	a5::Timer timer(60.0);
 	a5::Timer anim_timer(2.0);
 
 	std::string title("EO Map Editor 0.4.4 alpha");
@@ -339,6 +338,23 @@ int main(int argc, char** argv)
 	Map_Renderer map_renderer(map_display, font);
 	Palette pal[10] = {3, 4, 5, 6, 6, 7, 3, 22, 5, -1};
 	Pal_Renderer pal_renderer(pal_display);
+
+	// Decoded sprites are kept between runs in the user's data directory,
+	// if it can be created
+	if (ALLEGRO_PATH* cache_path = al_get_standard_path(ALLEGRO_USER_DATA_PATH))
+	{
+		al_append_path_component(cache_path, "gfx-cache");
+		const char* cache_dir = al_path_cstr(cache_path, ALLEGRO_NATIVE_PATH_SEP);
+
+		if (al_make_directory(cache_dir))
+		{
+			map_renderer.gfxloader.SetCacheDirectory(cache_dir);
+			pal_renderer.gfxloader.SetCacheDirectory(cache_dir);
+		}
+
+		al_destroy_path(cache_path);
+	}
+
 	float map_window_scale = 1.0f;
 	ALLEGRO_TRANSFORM identity_xform;
 	ALLEGRO_TRANSFORM map_scale_xform;
@@ -375,7 +391,9 @@ int main(int argc, char** argv)
 
 			map_display.Target();
 			map.Load(filename);
+			map_renderer.MapChanged();
 			map_renderer.ResetView();
+			map_renderer.BeginWarmUp();
 		}
 	};
 
@@ -415,14 +433,15 @@ int main(int argc, char** argv)
 		bool mouse_r_down = false;
 
 		running = true;
-		bool redraw = true;
-		bool pal_redraw = true;
+
+		Frame_Scheduler scheduler;
+		scheduler.InvalidateAll();
+		bool anim_timer_running = true;
 
 		double map_load_boost = 0.5; // 500ms
 		double pal_load_boost = 0.5; // 500ms
 
 		int pal_scrolled = -1;
-		int map_scrolled = -1;
 
 		map_display.Target();
 		a5::Bitmap cursor(load_bmp("cursor.bmp"));
@@ -446,6 +465,8 @@ int main(int argc, char** argv)
 		pal_renderer.ResetView();
 
 		bool map_drag_scroll = false;
+		bool minimap_drag = false;
+		bool show_render_stats = false;
 		bool pal_drag_scroll = false;
 
 		while (running)
@@ -457,6 +478,9 @@ int main(int argc, char** argv)
 				GUI::Event e = gui.events.back();
 				gui.events.pop_back();
 
+				// Menu commands and the dialogs they open can change either window
+				scheduler.InvalidateAll();
+
 				switch (e.subtype)
 				{
 					case GUI::Event::Command:
@@ -475,8 +499,9 @@ int main(int argc, char** argv)
 									newmap.height = gui.dialog_new_height - 1;
 									newmap.loaded = true;
 									map = newmap;
+									map_renderer.MapChanged();
 									map_renderer.ResetView();
-									redraw = true;
+									scheduler.Invalidate(Frame_Scheduler::Map);
 
 									map_filename.clear();
 
@@ -557,6 +582,7 @@ int main(int argc, char** argv)
                                     map.ambient_noise = gui.dialog_map_music_ambient;
                                     map.music_extra   = gui.dialog_map_music_control;
                                     map.Cleanup();
+                                    map_renderer.MapChanged();
 								}
 								Q_REGISTER_ALL()
 								break;
@@ -592,12 +618,15 @@ int main(int argc, char** argv)
 			}
 #endif // WIN32
 
-			e = q.Wait();
+			// Nothing is drawn until something changes, so when idle this
+			// blocks until the next event
+			double wait = scheduler.WaitTime(al_get_time());
+			e = (wait < 0.0) ? q.Wait() : q.Wait(wait);
 
 			bool ack_resize = false;
 			bool pal_ack_resize = false;
 
-			do
+			for (; e; e = q.Get())
 			{
 				a5::Timer::Event *te;
 				a5::Display::Event *de;
@@ -610,34 +639,12 @@ int main(int argc, char** argv)
 				}
 				else if ((te = dynamic_cast<a5::Timer::Event *>(e.get())))
 				{
-					if (te->source == &timer)
-					{
-						if (map.loaded)
-						{
-							if (scroll_up) { map_renderer.yoff -= 8 * scroll_multiplier; map_scrolled = 0; redraw = true; }
-							if (scroll_right) { map_renderer.xoff += 8 * scroll_multiplier; map_scrolled = 0; redraw = true; }
-							if (scroll_down) { map_renderer.yoff += 8 * scroll_multiplier; map_scrolled = 0; redraw = true; }
-							if (scroll_left) { map_renderer.xoff -= 8 * scroll_multiplier; map_scrolled = 0; redraw = true; }
-						}
-
-						if (pal_scroll_up) { pal_renderer.yoff -= 8 * scroll_multiplier; pal_scrolled = 0; pal_redraw = true; }
-						if (pal_scroll_down) { pal_renderer.yoff += 8 * scroll_multiplier; pal_scrolled = 0; pal_redraw = true; }
-
-						pal_renderer.yoff = std::max(std::min(pal_renderer.yoff, pal_renderer.pal->height - pal_renderer.target.Height()), 0);
-
-						if (map_scrolled >= 0)
-							redraw = true;
-
-						if (pal_scrolled >= 0)
-							pal_redraw = true;
-					}
-					else if (te->source == &anim_timer)
+					if (te->source == &anim_timer)
 					{
 						map_renderer.animation_state = (map_renderer.animation_state + 1) & 0x3;
-						redraw = true;
-
 						pal_renderer.animation_state = (pal_renderer.animation_state + 1) & 0x3;
-						pal_redraw = true;
+
+						scheduler.InvalidateAll(Frame_Scheduler::Animation);
 					}
 				}
 				else if ((de = dynamic_cast<a5::Display::Event *>(e.get())))
@@ -651,11 +658,11 @@ int main(int argc, char** argv)
 						else if (de->SubType() == a5::Display::Event::Resize)
 						{
 							ack_resize = true;
-							redraw = true;
+							scheduler.Invalidate(Frame_Scheduler::Map);
 						}
 						else if (de->SubType() == a5::Display::Event::Expose)
 						{
-							redraw = true;
+							scheduler.Invalidate(Frame_Scheduler::Map);
 						}
 					}
 					else if (de->source == &pal_display)
@@ -663,11 +670,11 @@ int main(int argc, char** argv)
 						if (de->SubType() == a5::Display::Event::Resize)
 						{
 							pal_ack_resize = true;
-							pal_redraw = true;
+							scheduler.Invalidate(Frame_Scheduler::Palette);
 						}
 						else if (de->SubType() == a5::Display::Event::Expose)
 						{
-							pal_redraw = true;
+							scheduler.Invalidate(Frame_Scheduler::Palette);
 						}
 					}
 				}
@@ -683,15 +690,18 @@ int main(int argc, char** argv)
 							}
 							else if (ke->keycode == a5::Keyboard::Key::F5)
 							{
-								redraw = true;
+								map_renderer.Invalidate();
+								scheduler.Invalidate(Frame_Scheduler::Map);
+							}
+							else if (ke->keycode == a5::Keyboard::Key::M)
+							{
+								map_renderer.minimap.visible = !map_renderer.minimap.visible;
+								scheduler.Invalidate(Frame_Scheduler::Map);
 							}
 							else if (ke->keycode == a5::Keyboard::Key::Up) scroll_up = true;
 							else if (ke->keycode == a5::Keyboard::Key::Right) scroll_right = true;
 							else if (ke->keycode == a5::Keyboard::Key::Down) scroll_down = true;
 							else if (ke->keycode == a5::Keyboard::Key::Left) scroll_left = true;
-
-							if (scroll_up || scroll_right || scroll_down || scroll_left)
-								map_scrolled = 0;
 						}
 						else if (ke->SubType() == a5::Keyboard::Event::Up)
 						{
@@ -711,7 +721,7 @@ int main(int argc, char** argv)
 							}
 							else if (ke->keycode == a5::Keyboard::Key::F5)
 							{
-								pal_redraw = true;
+								scheduler.Invalidate(Frame_Scheduler::Palette);
 							}
 							else if (ke->keycode == a5::Keyboard::Key::Up)
                                 pal_scroll_up = true;
@@ -738,31 +748,54 @@ int main(int argc, char** argv)
 							{
 								pal_renderer.yoff -= pal_renderer.target.Height() / 2;
 								pal_renderer.yoff = std::max(std::min(pal_renderer.yoff, pal_renderer.pal->height - pal_renderer.target.Height()), 0);
-								pal_redraw = true;
+								scheduler.Invalidate(Frame_Scheduler::Palette);
 								pal_scrolled = 0;
                             }
 							else if (ke->keycode == a5::Keyboard::Key::PgDn)
 							{
 								pal_renderer.yoff += pal_renderer.target.Height() / 2;
 								pal_renderer.yoff = std::max(std::min(pal_renderer.yoff, pal_renderer.pal->height - pal_renderer.target.Height()), 0);
-								pal_redraw = true;
+								scheduler.Invalidate(Frame_Scheduler::Palette);
 								pal_scrolled = 0;
                             }
 							else if (ke->keycode == a5::Keyboard::Key::Home)
 							{
 								pal_renderer.yoff = 0;
-								pal_redraw = true;
+								scheduler.Invalidate(Frame_Scheduler::Palette);
 								pal_scrolled = 0;
                             }
 							else if (ke->keycode == a5::Keyboard::Key::End)
 							{
 								pal_renderer.yoff = pal_renderer.pal->height - pal_renderer.target.Height();
-								pal_redraw = true;
+								scheduler.Invalidate(Frame_Scheduler::Palette);
 								pal_scrolled = 0;
                             }
 						}
 					}
 
+					if (ke->SubType() == a5::Keyboard::Event::Down)
+					{
+						if (ke->keycode == a5::Keyboard::Key::F3)
+						{
+							show_render_stats = !show_render_stats;
+							scheduler.Invalidate(Frame_Scheduler::Map);
+							scheduler.Invalidate(Frame_Scheduler::Palette);
+						}
+						else if (ke->keycode == a5::Keyboard::Key::F4)
+						{
+							if (map_renderer.stats.Logging())
+							{
+								map_renderer.stats.StopLog();
+								pal_renderer.stats.StopLog();
+							}
+							else
+							{
+								map_renderer.stats.StartLog("render_stats_map.log");
+								pal_renderer.stats.StartLog("render_stats_palette.log");
+							}
+						}
+					}
+
 					if (ke->keycode == a5::Keyboard::Key::LeftCtrl || ke->keycode == a5::Keyboard::Key::RightCtrl)
 					{
 						if (ke->SubType() == a5::Keyboard::Event::Down)
@@ -779,7 +812,28 @@ int main(int argc, char** argv)
 				{
 					if (map.loaded && me->display == map_display)
 					{
-						if (mouse_inrange && me->SubType() == a5::Mouse::Event::Down)
+						// Clicking or dragging on the minimap moves the view there
+						if (me->SubType() == a5::Mouse::Event::Down && me->button == a5::Mouse::Left
+						 && map_renderer.minimap.visible && map_renderer.minimap.Contains(me->x, me->y))
+						{
+							minimap_drag = true;
+						}
+
+						if (minimap_drag && (me->SubType() == a5::Mouse::Event::Down || me->SubType() == a5::Mouse::Event::Move))
+						{
+							map_renderer.minimap.ViewAt(me->x, me->y,
+								map_renderer.ViewWidth(), map_renderer.ViewHeight(),
+								map_renderer.xoff, map_renderer.yoff);
+
+							scheduler.Invalidate(Frame_Scheduler::Map);
+						}
+
+						if (minimap_drag)
+						{
+							if (me->SubType() == a5::Mouse::Event::Up && me->button == a5::Mouse::Left)
+								minimap_drag = false;
+						}
+						else if (mouse_inrange && me->SubType() == a5::Mouse::Event::Down)
 						{
 							if (me->button == a5::Mouse::Left)
 							{
@@ -788,6 +842,8 @@ int main(int argc, char** argv)
 								{
 									if (pal_renderer.pal->selected_tile != 0 || pal_renderer.pal->layer == 0)
 										EO_Map::SetTile(map.gfxrows[pal_renderer.pal->layer], pal_renderer.pal->selected_tile, mouse_tile_x, mouse_tile_y);
+
+									map_renderer.TileChanged(mouse_tile_x, mouse_tile_y);
 								}
 								else
 								{
@@ -962,8 +1018,10 @@ int main(int argc, char** argv)
 									{
 										map.SetTileSpec(EO_Map::Tile_Spec(pal_renderer.pal->selected_tile), mouse_tile_x, mouse_tile_y);
 									}
+
+									map_renderer.EntitiesChanged();
 								}
-								redraw = true;
+								scheduler.Invalidate(Frame_Scheduler::Map);
 							}
 							else if (me->button == a5::Mouse::Right)
 							{
@@ -971,12 +1029,14 @@ int main(int argc, char** argv)
 								if (pal_renderer.pal->layer < 9)
 								{
 									EO_Map::DelTile(map.gfxrows[pal_renderer.pal->layer], mouse_tile_x, mouse_tile_y);
+									map_renderer.TileChanged(mouse_tile_x, mouse_tile_y);
 								}
 								else
 								{
 									map.DelTileSpec(mouse_tile_x, mouse_tile_y);
+									map_renderer.EntitiesChanged();
 								}
-								redraw = true;
+								scheduler.Invalidate(Frame_Scheduler::Map);
 							}
 							else if (me->SubType() == a5::Mouse::Event::Down)
 							{
@@ -1008,8 +1068,7 @@ int main(int argc, char** argv)
 								acc_map_sdx += sdx;
 								acc_map_sdy += sdy;
 
-								map_scrolled = 0;
-								redraw = true;
+								scheduler.Invalidate(Frame_Scheduler::Map);
 
 								if (abs(acc_map_sdx) >= 1.f)
 								{
@@ -1041,10 +1100,13 @@ int main(int argc, char** argv)
 										{
 											if (pal_renderer.pal->selected_tile != 0 || pal_renderer.pal->layer == 0)
 												EO_Map::SetTile(map.gfxrows[pal_renderer.pal->layer], pal_renderer.pal->selected_tile, mouse_tile_x, mouse_tile_y);
+
+											map_renderer.TileChanged(mouse_tile_x, mouse_tile_y);
 										}
 										else if (pal_renderer.pal->selected_tile != 37)
 										{
 											map.SetTileSpec(EO_Map::Tile_Spec(pal_renderer.pal->selected_tile), mouse_tile_x, mouse_tile_y);
+											map_renderer.EntitiesChanged();
 										}
 									}
 
@@ -1053,15 +1115,17 @@ int main(int argc, char** argv)
 										if (pal_renderer.pal->layer < 9)
 										{
 											EO_Map::DelTile(map.gfxrows[pal_renderer.pal->layer], mouse_tile_x, mouse_tile_y);
+											map_renderer.TileChanged(mouse_tile_x, mouse_tile_y);
 										}
 										else
 										{
 											map.DelTileSpec(mouse_tile_x, mouse_tile_y);
+											map_renderer.EntitiesChanged();
 										}
 									}
 								}
 
-								redraw = true;
+								scheduler.Invalidate(Frame_Scheduler::Map);
 							}
 
 							ALLEGRO_KEYBOARD_STATE kstate;
@@ -1069,26 +1133,24 @@ int main(int argc, char** argv)
 							bool ctrl = al_key_down(&kstate, ALLEGRO_KEY_LCTRL) || al_key_down(&kstate, ALLEGRO_KEY_RCTRL);
 
 							if (ctrl && me->dz) {
+								float old_scale = map_window_scale;
+
 								while (me->dz > 0 && map_window_scale < 2.0f)
 								{
 									--me->dz;
 									map_window_scale += 0.1f;
-									map_renderer.xoff += map_display.Width() * 0.05f;
-									map_renderer.yoff += map_display.Height() * 0.05f;
 								}
-								while (me->dz < 0 && map_window_scale > 0.5f)
+								while (me->dz < 0 && map_window_scale > 0.1f)
 								{
 									++me->dz;
 									map_window_scale -= 0.1f;
-									map_renderer.xoff -= map_display.Width() * 0.05f;
-									map_renderer.yoff -= map_display.Height() * 0.05f;
 								}
 
 								if (map_window_scale >= 0.99f && map_window_scale <= 1.01f)
 									map_window_scale = 1.0f;
 
-								if (map_window_scale < 0.5f)
-									map_window_scale = 0.5f;
+								if (map_window_scale < 0.1f)
+									map_window_scale = 0.1f;
 
 								if (map_window_scale > 2.0f)
 									map_window_scale = 2.0f;
@@ -1100,13 +1162,16 @@ int main(int argc, char** argv)
 								al_copy_transform(&map_scale_xform_inverse, &map_scale_xform);
 								al_invert_transform(&map_scale_xform_inverse);
 
+								// Keep the middle of the view in place
+								float half_w = map_display.Width() * 0.5f;
+								float half_h = map_display.Height() * 0.5f;
+								map_renderer.xoff += half_w / old_scale - half_w / map_window_scale;
+								map_renderer.yoff += half_h / old_scale - half_h / map_window_scale;
+
 								map_display.Target();
-								map_renderer.RebuildTarget(
-									map_display.Width() / map_window_scale,
-									map_display.Height() / map_window_scale
-								);
+								map_renderer.SetZoom(map_window_scale, map_display.Width(), map_display.Height());
 
-								redraw = true;
+								scheduler.Invalidate(Frame_Scheduler::Map);
 							}
 						}
 						else if (me->SubType() == a5::Mouse::Event::Up)
@@ -1166,7 +1231,7 @@ int main(int argc, char** argv)
 									pal_renderer.pal->Click(me->x, pal_renderer.yoff + me->y);
 								}
 
-								pal_redraw = true;
+								scheduler.Invalidate(Frame_Scheduler::Palette);
 							}
 							else if (me->button == a5::Mouse::Middle)
 							{
@@ -1177,7 +1242,8 @@ int main(int argc, char** argv)
 								if (pal_renderer.pal->layer == 0)
 								{
 									map.fill_tile = pal_renderer.pal->RightClick(me->x, pal_renderer.yoff + me->y);
-									redraw = true;
+									map_renderer.Invalidate();
+									scheduler.Invalidate(Frame_Scheduler::Map);
 			 					}
 							}
 						}
@@ -1193,7 +1259,7 @@ int main(int argc, char** argv)
 							if (pal_drag_scroll)
 							{
 								pal_scrolled = 0;
-								pal_redraw = true;
+								scheduler.Invalidate(Frame_Scheduler::Palette);
 								pal_renderer.yoff -= me->dy * scroll_multiplier;
 								pal_renderer.yoff = std::max(std::min(pal_renderer.yoff, pal_renderer.pal->height - pal_renderer.target.Height()), 0);
 							}
@@ -1201,20 +1267,20 @@ int main(int argc, char** argv)
 							if (me->dz)
 							{
 								pal_scrolled = 0;
-								pal_redraw = true;
+								scheduler.Invalidate(Frame_Scheduler::Palette);
 								pal_renderer.yoff -= me->dz * 96 * scroll_multiplier;
 								pal_renderer.yoff = std::max(std::min(pal_renderer.yoff, pal_renderer.pal->height - pal_renderer.target.Height()), 0);
 							}
 						}
 					}
 				}
-			} while ((e = q.Get()));
+			}
 
 			if (ack_resize)
 			{
 				map_display.Target();
 				al_acknowledge_resize(map_display);
-				map_renderer.RebuildTarget(map_display.Width() / map_window_scale, map_display.Height() / map_window_scale);
+				map_renderer.SetZoom(map_window_scale, map_display.Width(), map_display.Height());
 			}
 
 			if (pal_ack_resize)
@@ -1223,15 +1289,50 @@ int main(int argc, char** argv)
 				al_acknowledge_resize(pal_display);
 			}
 
-			if (map_scrolled == 0 || pal_scrolled == 0)
+			// Held scroll keys move the view once per frame
+			if (map.loaded && (scroll_up || scroll_right || scroll_down || scroll_left))
+				scheduler.Invalidate(Frame_Scheduler::Map, Frame_Scheduler::Scrolling);
+
+			if (pal_scroll_up || pal_scroll_down)
+				scheduler.Invalidate(Frame_Scheduler::Palette, Frame_Scheduler::Scrolling);
+
+			// Both windows are drawn together when they're both due
+			double now = al_get_time();
+			unsigned map_sources = 0;
+			unsigned pal_sources = 0;
+
+			if (scheduler.Due(Frame_Scheduler::Map, now))
+				map_sources = scheduler.BeginFrame(Frame_Scheduler::Map, now);
+
+			if (scheduler.Due(Frame_Scheduler::Palette, now))
+				pal_sources = scheduler.BeginFrame(Frame_Scheduler::Palette, now);
+
+			if (map_sources & Frame_Scheduler::Scrolling)
 			{
-				timer.Start();
+				if (scroll_up) map_renderer.yoff -= 8 * scroll_multiplier;
+				if (scroll_right) map_renderer.xoff += 8 * scroll_multiplier;
+				if (scroll_down) map_renderer.yoff += 8 * scroll_multiplier;
+				if (scroll_left) map_renderer.xoff -= 8 * scroll_multiplier;
 			}
 
+			if (pal_sources & Frame_Scheduler::Scrolling)
+			{
+				if (pal_scroll_up) pal_renderer.yoff -= 8 * scroll_multiplier;
+				if (pal_scroll_down) pal_renderer.yoff += 8 * scroll_multiplier;
+
+				pal_renderer.yoff = std::max(std::min(pal_renderer.yoff, pal_renderer.pal->height - pal_renderer.target.Height()), 0);
+				pal_scrolled = 0;
+			}
+
+			// Animation ticks alone only redraw animated sprites over the last frame
+			bool redraw = (map_sources & ~Frame_Scheduler::Animation) != 0;
+			bool anim_redraw = (map_sources == Frame_Scheduler::Animation);
+			bool pal_redraw = (pal_sources != 0);
+
 			double frame_load_time = 0.025; // 25ms
 
 			// Allocation is shared between both windows
-			if (redraw)
+			if (redraw || anim_redraw)
 			{
 				map_renderer.gfxloader.SetLoadTime(frame_load_time + map_load_boost);
 				map_load_boost = 0.0;
@@ -1243,35 +1344,53 @@ int main(int argc, char** argv)
 				pal_load_boost = 0.0;
 			}
 
-			if (redraw)
+			if (redraw || anim_redraw)
 			{
 				map_renderer.target.Target();
 				a5::disable_auto_target = true;
-				map_renderer.target.Clear();
 
 				if (map.loaded)
 				{
 					al_hold_bitmap_drawing(true);
 
-					map_renderer.Render();
-
-					if (mouse_inrange)
-					{
-						int mouse_draw_x = (mouse_tile_x << 5) - (mouse_tile_y << 5) - map_renderer.xoff;
-						int mouse_draw_y = (mouse_tile_x << 4) + (mouse_tile_y << 4) - map_renderer.yoff;
-						map_renderer.target.Blit(cursor, mouse_draw_x, mouse_draw_y);
-					}
+					if (redraw)
+						map_renderer.Render();
+					else
+						map_renderer.RenderAnimation();
 
 					al_hold_bitmap_drawing(false);
 				}
+				else
+				{
+					map_renderer.target.Clear();
+					map_renderer.Invalidate();
+				}
 
 				map_display.Target();
 
 				map_display.Clear();
-				al_use_transform(&map_scale_xform);
+
+				// LOD frames are already drawn at the zoomed size
+				if (!map_renderer.LodActive())
+					al_use_transform(&map_scale_xform);
+
 				map_display.Blit(map_renderer.target, 0, 0);
+				al_use_transform(&map_scale_xform);
+
+				// The cursor goes on the display so the frame in target can
+				// be kept between animation ticks
+				if (map.loaded && mouse_inrange)
+				{
+					int mouse_draw_x = (mouse_tile_x << 5) - (mouse_tile_y << 5) - map_renderer.xoff;
+					int mouse_draw_y = (mouse_tile_x << 4) + (mouse_tile_y << 4) - map_renderer.yoff;
+					map_display.Blit(cursor, mouse_draw_x, mouse_draw_y);
+				}
+
 				al_use_transform(&identity_xform);
 
+				if (map.loaded && map_renderer.minimap.visible)
+					map_renderer.DrawMinimap(map_display);
+
 				if (map.loaded && mouse_inrange)
 				{
 					al_draw_textf(
@@ -1290,17 +1409,36 @@ int main(int argc, char** argv)
 						ALLEGRO_ALIGN_RIGHT, "Zoom: %d%%", (int)(map_window_scale * 100.f + 0.25f)
 					);
 
+				if (map.loaded && map_renderer.WarmingUp())
+				{
+					int bar_x = 8;
+					int bar_y = map_display.Height() - 20;
+					int bar_w = 160;
+
+					al_draw_filled_rectangle(bar_x - 4, bar_y - 16, bar_x + bar_w + 4, bar_y + 12, a5::Color(a5::RGBA(0, 0, 0, 160)));
+					al_draw_filled_rectangle(bar_x, bar_y, bar_x + bar_w * map_renderer.WarmUpProgress(), bar_y + 8, a5::Color(a5::RGB(255, 255, 255)));
+
+					al_draw_textf(
+						font, a5::Color(a5::RGB(255, 255, 255)),
+						bar_x, bar_y - 12,
+						ALLEGRO_ALIGN_LEFT, "Loading graphics: %d%%", int(map_renderer.WarmUpProgress() * 100.f)
+					);
+				}
+
+				if (show_render_stats)
+					map_renderer.stats.DrawHUD(font, 8, 8);
+
 				map_display.Flip();
 				a5::disable_auto_target = false;
 
-				if (map_renderer.gfxloader.dummy_frames_loaded == 0)
-					redraw = false;
+				// Sprites that didn't finish loading, LOD tiles still to be
+				// rendered and a warm-up still preloading sprites need a full
+				// redraw, even if only animation was drawn
+				if (map_renderer.gfxloader.dummy_frames_loaded != 0 || map_renderer.lod_pending
+				 || (map.loaded && map_renderer.WarmingUp()))
+					scheduler.Invalidate(Frame_Scheduler::Map, Frame_Scheduler::Loading);
 
-				if (map_scrolled != -1)
-				{
-					if (++map_scrolled == 120)
-						map_scrolled = -1;
-				}
+				scheduler.SetAnimated(Frame_Scheduler::Map, map.loaded && map_renderer.HasAnimation());
 			}
 
 			if (pal_redraw)
@@ -1340,18 +1478,31 @@ int main(int argc, char** argv)
 
 					if (pal_scrolled == 120)
 						pal_scrolled = -1;
+					else
+						scheduler.Invalidate(Frame_Scheduler::Palette, Frame_Scheduler::Scrollbar);
 				}
 
-				if (pal_renderer.gfxloader.dummy_frames_loaded == 0)
-					pal_redraw = false;
+				if (show_render_stats)
+					pal_renderer.stats.DrawHUD(font, 8, 40);
+
+				if (pal_renderer.gfxloader.dummy_frames_loaded != 0)
+					scheduler.Invalidate(Frame_Scheduler::Palette, Frame_Scheduler::Loading);
+
+				scheduler.SetAnimated(Frame_Scheduler::Palette, pal_renderer.HasAnimation());
 
 				pal_renderer.target.Flip();
 				a5::disable_auto_target = false;
 			}
 
-			if (map_scrolled < 0 && pal_scrolled < 0)
+			// The animation timer only runs while something animated is shown
+			if (scheduler.Animating() != anim_timer_running)
 			{
-				timer.Stop();
+				anim_timer_running = scheduler.Animating();
+
+				if (anim_timer_running)
+					anim_timer.Start();
+				else
+					anim_timer.Stop();
 			}
 		}
 	}
@@ -0,0 +1,114 @@
+#include "mapped_file.hpp"
+
+#include <utility>
+
+#ifdef WIN32
+#include <windows.h>
+#else // WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // WIN32
+
+#ifdef WIN32
+mapped_file::mapped_file(const char* filename) noexcept
+{
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+
+	LARGE_INTEGER file_size;
+
+	if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+		m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+	// The mapping keeps the file open
+	CloseHandle(file);
+
+	if (!m_mapping)
+		return;
+
+	m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+
+	if (!m_data)
+	{
+		CloseHandle(m_mapping);
+		m_mapping = nullptr;
+		return;
+	}
+
+	m_size = std::size_t(file_size.QuadPart);
+}
+#else // WIN32
+mapped_file::mapped_file(const char* filename) noexcept
+{
+	int fd = ::open(filename, O_RDONLY);
+
+	if (fd == -1)
+		return;
+
+	struct stat st;
+
+	if (::fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		void* p = ::mmap(nullptr, std::size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (p != MAP_FAILED)
+		{
+			m_data = static_cast<const char*>(p);
+			m_size = std::size_t(st.st_size);
+		}
+	}
+
+	// The mapping keeps the file open
+	::close(fd);
+}
+#endif // WIN32
+
+mapped_file::mapped_file(mapped_file&& other) noexcept
+	: m_data(std::exchange(other.m_data, nullptr))
+	, m_size(std::exchange(other.m_size, 0))
+#ifdef WIN32
+	, m_mapping(std::exchange(other.m_mapping, nullptr))
+#endif // WIN32
+{ }
+
+mapped_file& mapped_file::operator=(mapped_file&& other) noexcept
+{
+	if (this != &other)
+	{
+		this->close();
+
+		m_data = std::exchange(other.m_data, nullptr);
+		m_size = std::exchange(other.m_size, 0);
+#ifdef WIN32
+		m_mapping = std::exchange(other.m_mapping, nullptr);
+#endif // WIN32
+	}
+
+	return *this;
+}
+
+mapped_file::~mapped_file()
+{
+	this->close();
+}
+
+void mapped_file::close() noexcept
+{
+	if (!m_data)
+		return;
+
+#ifdef WIN32
+	UnmapViewOfFile(m_data);
+	CloseHandle(m_mapping);
+	m_mapping = nullptr;
+#else // WIN32
+	::munmap(const_cast<char*>(m_data), m_size);
+#endif // WIN32
+
+	m_data = nullptr;
+	m_size = 0;
+}
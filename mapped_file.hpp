@@ -0,0 +1,50 @@
+#ifndef EOMAP_MAPPED_FILE_HPP
+#define EOMAP_MAPPED_FILE_HPP
+
+#include <cstddef>
+
+// Maps a whole file in to memory read-only, so it can be parsed and read
+// from in place by any number of threads at once
+class mapped_file
+{
+	private:
+		const char* m_data = nullptr;
+		std::size_t m_size = 0;
+
+#ifdef WIN32
+		void* m_mapping = nullptr;
+#endif // WIN32
+
+	public:
+		mapped_file() = default;
+
+		// Check the result with operator bool, as with cio::stream
+		explicit mapped_file(const char* filename) noexcept;
+
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+
+		mapped_file(mapped_file&& other) noexcept;
+		mapped_file& operator=(mapped_file&& other) noexcept;
+
+		~mapped_file();
+
+		void close() noexcept;
+
+		const char* data() const noexcept
+		{
+			return m_data;
+		}
+
+		std::size_t size() const noexcept
+		{
+			return m_size;
+		}
+
+		explicit operator bool() const noexcept
+		{
+			return m_data != nullptr;
+		}
+};
+
+#endif // EOMAP_MAPPED_FILE_HPP
@@ -7,11 +7,24 @@
 #include <cstring>
 #include <vector>
 
+size_t pe_reader::read(char* buf, size_t n)
+{
+	size_t available = (pos < file.size()) ? std::min(n, file.size() - pos) : 0;
+
+	if (available > 0)
+		std::memcpy(buf, file.data() + pos, available);
+
+	std::memset(buf + available, 0, n - available);
+	pos += n;
+
+	return available;
+}
+
 uint16_t pe_reader::read_u16_le()
 {
 	char buf[2];
 
-	if (file.read(buf, 2) == 2)
+	if (read(buf, 2) == 2)
 	{
 		return int_pack_16_le(buf[0], buf[1]);
 	}
@@ -23,7 +36,7 @@ uint32_t pe_reader::read_u32_le()
 {
 	char buf[4];
 
-	if (file.read(buf, 4) == 4)
+	if (read(buf, 4) == 4)
 	{
 		return int_pack_32_le(buf[0], buf[1], buf[2], buf[3]);
 	}
@@ -65,22 +78,22 @@ bool pe_reader::read_header()
 {
 	char buf[8];
 
-	file.seek(0x3C);
+	seek(0x3C);
 	uint16_t pe_header_address = read_u16_le();
 
-	file.skip(pe_header_address - 0x3C - 0x02);
-	file.read(buf, 4);
+	skip(pe_header_address - 0x3C - 0x02);
+	read(buf, 4);
 
 	if (std::memcmp(buf, "PE\0", 4) != 0)
 		return false;
 
-	file.skip(0x02);
+	skip(0x02);
 	uint16_t sections = read_u16_le();
 
-	file.skip(0x78 - 0x04 + 0x0C);
+	skip(0x78 - 0x04 + 0x0C);
 	virtual_address = read_u32_le();
 
-	file.skip(0x6C + 0x08 + 0x04);
+	skip(0x6C + 0x08 + 0x04);
 
 	for (unsigned int i = 0; i < sections; ++i)
 	{
@@ -88,19 +101,19 @@ bool pe_reader::read_header()
 
 		if (check_virtual_address == virtual_address)
 		{
-			file.skip(0x04);
+			skip(0x04);
 
 			root_address = read_u32_le();
 			break;
 		}
 
-		file.skip(0x24);
+		skip(0x24);
 	}
 
 	if (!root_address)
 		return false;
 
-	file.seek(root_address);
+	seek(root_address);
 
 	ResourceDirectory root_directory = read_ResourceDirectory();
 
@@ -121,7 +134,7 @@ bool pe_reader::read_header()
 
 			bitmap_directory_entry = entry;
 
-			file.skip(8 * (directory_entries - i - 1));
+			skip(8 * (directory_entries - i - 1));
 
 			break;
 		}
@@ -139,10 +152,10 @@ std::map<int, pe_reader::BitmapInfo> pe_reader::read_bitmap_table()
 	if (bitmap_directory_entry.ResourceType_ != ResourceType::Bitmap)
 		return bitmap_pointers;
 
-	file.seek(root_address + bitmap_directory_entry.SubDirectoryOffset);
+	seek(root_address + bitmap_directory_entry.SubDirectoryOffset);
 
 	ResourceDirectory bitmap_directory;
-	file.read(buf, 16);
+	read(buf, 16);
 	bitmap_directory.NumberOfNamedEntries = int_pack_16_le(buf + 12);
 	bitmap_directory.NumberOfIdEntries = int_pack_16_le(buf + 14);
 
@@ -155,7 +168,7 @@ std::map<int, pe_reader::BitmapInfo> pe_reader::read_bitmap_table()
 
 	for (unsigned int i = 0; i < directory_entries; ++i)
 	{
-		file.read(buf, 8);
+		read(buf, 8);
 		entry.ResourceType_ = ResourceType(int_pack_32_le(buf));
 		entry.SubDirectoryOffset = int_pack_32_le(buf + 4);
 
@@ -170,21 +183,21 @@ std::map<int, pe_reader::BitmapInfo> pe_reader::read_bitmap_table()
 
 	for (auto it = bitmap_entries.begin(); it != bitmap_entries.end(); ++it)
 	{
-		file.seek(root_address + it->SubDirectoryOffset + 16);
+		seek(root_address + it->SubDirectoryOffset + 16);
 
-		file.read(buf, 8);
+		read(buf, 8);
 		entry.SubDirectoryOffset = int_pack_32_le(buf + 4);
 
-		file.seek(root_address + entry.SubDirectoryOffset);
+		seek(root_address + entry.SubDirectoryOffset);
 
-		file.read(buf, 16);
+		read(buf, 16);
 		data_entry.OffsetToData = int_pack_32_le(buf);
 		data_entry.Size = int_pack_32_le(buf + 4);
 
 		size_t start = data_entry.OffsetToData - virtual_address + root_address;
 		size_t size = data_entry.Size;
 
-		file.seek(start + 4);
+		seek(start + 4);
 
 		int width = read_u32_le();
 		int height = read_u32_le();
@@ -196,14 +209,3 @@ std::map<int, pe_reader::BitmapInfo> pe_reader::read_bitmap_table()
 
 	return bitmap_pointers;
 }
-
-bool pe_reader::read_resource(char* buf, size_t start, size_t size)
-{
-	if (!file.seek(start))
-		return false;
-
-	if (file.read(buf, size) != size)
-		return false;
-
-	return true;
-}
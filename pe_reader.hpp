@@ -1,8 +1,8 @@
 #ifndef EOMAP_PE_READER_HPP
 #define EOMAP_PE_READER_HPP
 
-#include "cio.hpp"
 #include "common.hpp"
+#include "mapped_file.hpp"
 
 #include <algorithm>
 #include <cstdint>
@@ -63,8 +63,23 @@ class pe_reader
 			uint32_t unused;
 		};
 
-		cio::stream file;
-		
+		mapped_file file;
+
+		// Read position in the mapping, reads past the end give zeroes
+		size_t pos = 0;
+
+		void seek(size_t offset)
+		{
+			pos = offset;
+		}
+
+		void skip(size_t n)
+		{
+			pos += n;
+		}
+
+		size_t read(char* buf, size_t n);
+
 		uint32_t root_address = 0;
 		uint32_t virtual_address = 0;
 		ResourceDirectoryEntry bitmap_directory_entry = {ResourceType{}, 0};
@@ -77,7 +92,7 @@ class pe_reader
 		ResourceDataEntry read_ResourceDataEntry();
 
 	public:
-		pe_reader(cio::stream&& file)
+		pe_reader(mapped_file&& file)
 			: file(std::move(file))
 		{ }
 
@@ -85,16 +100,14 @@ class pe_reader
 
 		std::map<int, BitmapInfo> read_bitmap_table();
 
-		bool read_resource(char* buf, size_t start, size_t size);
-
-		cio::stream& get_file()
+		// Returns the resource's data in the mapping, or nullptr if it runs
+		// past the end of the file. Safe to call from any thread.
+		const char* resource(size_t start, size_t size) const
 		{
-			return file;
-		}
+			if (start > file.size() || size > file.size() - start)
+				return nullptr;
 
-		cio::stream&& finish()
-		{
-			return std::move(file);
+			return file.data() + start;
 		}
 };
 
@@ -0,0 +1,211 @@
+#include "png_writer.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+// zlib's crc32 is declared under another name, so that chunks are summed
+// by the one in crc32.c, which is the one the program links with
+#define crc32 zlib_crc32
+#include <zlib.h>
+#undef crc32
+
+extern "C"
+{
+#include "crc32.h"
+}
+
+// Size of the IDAT chunks the compressed image is split in to
+static const std::size_t idat_size = 256 * 1024;
+
+static void put_u32_be(unsigned char* p, std::uint32_t value)
+{
+	p[0] = (value >> 24) & 0xFF;
+	p[1] = (value >> 16) & 0xFF;
+	p[2] = (value >>  8) & 0xFF;
+	p[3] = (value      ) & 0xFF;
+}
+
+png_writer::png_writer() = default;
+
+png_writer::~png_writer()
+{
+	if (stream)
+		deflateEnd(stream.get());
+
+	if (fh)
+		std::fclose(fh);
+}
+
+void png_writer::write_bytes(const void* data, std::size_t size)
+{
+	if (!failed && std::fwrite(data, 1, size, fh) != size)
+		failed = true;
+}
+
+void png_writer::write_chunk(const char* type, const unsigned char* data, std::size_t size)
+{
+	unsigned char length[4];
+	put_u32_be(length, std::uint32_t(size));
+
+	u32 crc = crc32(0, reinterpret_cast<const u8*>(type), 4);
+
+	if (size > 0)
+		crc = crc32(crc, data, size);
+
+	unsigned char crc_be[4];
+	put_u32_be(crc_be, crc);
+
+	write_bytes(length, 4);
+	write_bytes(type, 4);
+
+	if (size > 0)
+		write_bytes(data, size);
+
+	write_bytes(crc_be, 4);
+}
+
+void png_writer::write_compressed(const unsigned char* data, std::size_t size, int flush)
+{
+	stream->next_in = const_cast<Bytef*>(data);
+	stream->avail_in = uInt(size);
+
+	// deflate has filled idat whenever it leaves no space in it
+	do
+	{
+		stream->next_out = idat.data();
+		stream->avail_out = uInt(idat.size());
+
+		if (deflate(stream.get(), flush) == Z_STREAM_ERROR)
+		{
+			failed = true;
+			return;
+		}
+
+		std::size_t produced = idat.size() - stream->avail_out;
+
+		if (produced > 0)
+			write_chunk("IDAT", idat.data(), produced);
+	} while (stream->avail_out == 0);
+}
+
+bool png_writer::open(const char* filename, int width, int height)
+{
+	if (width <= 0 || height <= 0)
+		return false;
+
+	fh = std::fopen(filename, "wb");
+
+	if (!fh)
+		return false;
+
+	this->width = width;
+	this->height = height;
+
+	static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	write_bytes(signature, sizeof signature);
+
+	unsigned char ihdr[13];
+	put_u32_be(ihdr, width);
+	put_u32_be(ihdr + 4, height);
+	ihdr[8] = 8;  // bit depth
+	ihdr[9] = 2;  // truecolor
+	ihdr[10] = 0; // deflate
+	ihdr[11] = 0; // adaptive filtering
+	ihdr[12] = 0; // not interlaced
+	write_chunk("IHDR", ihdr, sizeof ihdr);
+
+	stream = std::make_unique<z_stream>();
+
+	if (deflateInit(stream.get(), Z_DEFAULT_COMPRESSION) != Z_OK)
+	{
+		stream.reset();
+		std::fclose(fh);
+		fh = nullptr;
+		return false;
+	}
+
+	std::size_t row_size = std::size_t(width) * 3;
+	row_bytes.resize(row_size);
+	prev_row_bytes.assign(row_size, 0);
+
+	for (std::vector<unsigned char>& f : filtered)
+		f.resize(row_size + 1);
+
+	idat.resize(idat_size);
+
+	return !failed;
+}
+
+void png_writer::write_row(const std::uint32_t* row)
+{
+	if (!fh || rows_written >= height)
+		return;
+
+	std::size_t row_size = row_bytes.size();
+
+	for (int x = 0; x < width; ++x)
+	{
+		row_bytes[x * 3    ] = (row[x] >> 16) & 0xFF;
+		row_bytes[x * 3 + 1] = (row[x] >>  8) & 0xFF;
+		row_bytes[x * 3 + 2] = (row[x]      ) & 0xFF;
+	}
+
+	// Each row gets whichever of the None, Sub and Up filters leaves the
+	// smallest sum of magnitudes, the same guess libpng makes
+	unsigned char* none = filtered[0].data();
+	unsigned char* sub = filtered[1].data();
+	unsigned char* up = filtered[2].data();
+
+	none[0] = 0;
+	sub[0] = 1;
+	up[0] = 2;
+
+	unsigned long sums[3] = {0, 0, 0};
+
+	for (std::size_t i = 0; i < row_size; ++i)
+	{
+		unsigned char left = (i >= 3) ? row_bytes[i - 3] : 0;
+
+		none[i + 1] = row_bytes[i];
+		sub[i + 1] = row_bytes[i] - left;
+		up[i + 1] = row_bytes[i] - prev_row_bytes[i];
+
+		sums[0] += std::abs(int(static_cast<signed char>(none[i + 1])));
+		sums[1] += std::abs(int(static_cast<signed char>(sub[i + 1])));
+		sums[2] += std::abs(int(static_cast<signed char>(up[i + 1])));
+	}
+
+	int best = int(std::min_element(sums, sums + 3) - sums);
+
+	write_compressed(filtered[best].data(), row_size + 1, Z_NO_FLUSH);
+
+	std::swap(row_bytes, prev_row_bytes);
+	++rows_written;
+}
+
+bool png_writer::close()
+{
+	if (!fh)
+		return false;
+
+	// Rows that were never written are left black
+	std::vector<std::uint32_t> blank(width, 0);
+
+	while (rows_written < height)
+		write_row(blank.data());
+
+	write_compressed(nullptr, 0, Z_FINISH);
+	deflateEnd(stream.get());
+	stream.reset();
+
+	write_chunk("IEND", nullptr, 0);
+
+	if (std::fclose(fh) != 0)
+		failed = true;
+
+	fh = nullptr;
+
+	return !failed;
+}
@@ -0,0 +1,56 @@
+#ifndef EOMAP_PNG_WRITER_HPP
+#define EOMAP_PNG_WRITER_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+struct z_stream_s;
+
+// Writes an RGB PNG a row at a time, so images far bigger than memory
+// can be produced. Rows are filtered and compressed as they arrive, and
+// the compressed data is written out an IDAT chunk at a time.
+class png_writer
+{
+	private:
+		std::FILE* fh = nullptr;
+		bool failed = false;
+
+		int width = 0;
+		int height = 0;
+		int rows_written = 0;
+
+		std::unique_ptr<z_stream_s> stream;
+
+		// Unfiltered bytes of the current and previous rows
+		std::vector<unsigned char> row_bytes;
+		std::vector<unsigned char> prev_row_bytes;
+
+		// The current row with each filter applied, filter type first
+		std::vector<unsigned char> filtered[3];
+
+		// Compressed data waiting to fill an IDAT chunk
+		std::vector<unsigned char> idat;
+
+		void write_bytes(const void* data, std::size_t size);
+		void write_chunk(const char* type, const unsigned char* data, std::size_t size);
+		void write_compressed(const unsigned char* data, std::size_t size, int flush);
+
+	public:
+		png_writer();
+		png_writer(const png_writer&) = delete;
+		png_writer& operator=(const png_writer&) = delete;
+
+		~png_writer();
+
+		bool open(const char* filename, int width, int height);
+
+		// row points to width pixels of 0xAARRGGBB, alpha is dropped
+		void write_row(const std::uint32_t* row);
+
+		// Returns false if anything failed to write
+		bool close();
+};
+
+#endif // EOMAP_PNG_WRITER_HPP